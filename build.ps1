@@ -79,7 +79,7 @@ Write-Host "  Generated: query.lex.c" -ForegroundColor Green
 
 Write-Host ""
 Write-Host "Step 5: Compiling C source files..." -ForegroundColor Cyan
-$sources = @("main.c", "engine.c", "json.tab.c", "json.lex.c", "query.tab.c", "query.lex.c")
+$sources = @("main.c", "engine.c", "json_number.c", "json_atom.c", "json_shape.c", "json_filter.c", "json_arena.c", "json_input.c", "json_output.c", "json_structural.c", "json_parser.c", "json_parallel.c", "json.tab.c", "json.lex.c", "query.tab.c", "query.lex.c")
 $objects = @()
 
 foreach ($src in $sources) {
@@ -96,7 +96,7 @@ foreach ($src in $sources) {
 
 Write-Host ""
 Write-Host "Step 6: Linking executable..." -ForegroundColor Cyan
-gcc -Wall -g -o jqlite.exe $objects
+gcc -Wall -g -o jqlite.exe $objects -lpthread
 if ($LASTEXITCODE -ne 0) {
     Write-Host "ERROR: Failed to link executable" -ForegroundColor Red
     exit 1
@@ -67,7 +67,7 @@ REM Step 7: Link all objects (reuse normal JSON parser)
 echo [7/7] Linking jqlite_viz.exe...
 gcc -o jqlite_viz.exe main_visualize.o engine_visualize.o ^
     query_visualize.tab.o query_visualize.lex.o ^
-    json.tab.o json.lex.o
+    json.tab.o json.lex.o json_number.o json_atom.o json_shape.o json_arena.o json_input.o json_output.o -lpthread
 if %ERRORLEVEL% NEQ 0 (
     echo ❌ Error: Failed to link jqlite_viz.exe
     exit /b 1
@@ -83,7 +83,7 @@ Write-Host "query_visualize.lex.o created" -ForegroundColor Green
 Write-Host "[7/7] Linking jqlite_viz.exe..." -ForegroundColor Yellow
 gcc -o jqlite_viz.exe main_visualize.o engine_visualize.o `
     query_visualize.tab.o query_visualize.lex.o `
-    json.tab.o json.lex.o
+    json.tab.o json.lex.o json_number.o json_atom.o json_shape.o json_arena.o json_input.o json_output.o -lpthread
 if ($LASTEXITCODE -ne 0) {
     Write-Host "Error: Failed to link jqlite_viz.exe" -ForegroundColor Red
     exit 1
@@ -2,7 +2,7 @@
  * engine.c
  * 
  * UPGRADED VERSION: Implementation of the query execution engine with:
- * - Hash table support for fast object lookups (uthash)
+ * - Flat object storage with a hash index for large objects
  * - Pipe operator support
  * - select() filtering
  * - Array slicing
@@ -12,19 +12,41 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
 #include "json_value.h"
+#include "json_number.h"
+#include "json_atom.h"
+#include "json_shape.h"
+#include "json_output.h"
+#include "json_parser.h"
+#include "json_filter.h"
 
 /* Forward declarations for internal functions */
-static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data);
-static int evaluate_condition(ConditionExpr* condition, JsonValue* item);
 static JsonValue* clone_json_value_internal(JsonValue* value);
 
+/**
+ * Allocate a JSON value of the given type.
+ * Values come from the current arena while one is set (see json_arena.h),
+ * otherwise from the heap.
+ * 
+ * @param type The type of the new value
+ */
+static JsonValue* alloc_json_value(JsonType type) {
+    JsonValue* val = (JsonValue*)json_alloc(sizeof(JsonValue));
+    val->type = type;
+    val->flags = json_arena_current() ? JSON_FLAG_ARENA : 0;
+    atomic_init(&val->refcount, 1);
+    return val;
+}
+
 /**
  * Create a new JSON null value.
  */
 JsonValue* create_json_null() {
-    JsonValue* val = (JsonValue*)malloc(sizeof(JsonValue));
-    val->type = JSON_NULL;
+    JsonValue* val = alloc_json_value(JSON_NULL);
     return val;
 }
 
@@ -34,8 +56,7 @@ JsonValue* create_json_null() {
  * @param is_true 1 for true, 0 for false
  */
 JsonValue* create_json_bool(int is_true) {
-    JsonValue* val = (JsonValue*)malloc(sizeof(JsonValue));
-    val->type = is_true ? JSON_TRUE : JSON_FALSE;
+    JsonValue* val = alloc_json_value(is_true ? JSON_TRUE : JSON_FALSE);
     return val;
 }
 
@@ -45,9 +66,36 @@ JsonValue* create_json_bool(int is_true) {
  * @param num The numeric value
  */
 JsonValue* create_json_number(double num) {
-    JsonValue* val = (JsonValue*)malloc(sizeof(JsonValue));
-    val->type = JSON_NUMBER;
-    val->value.number = num;
+    JsonValue* val = alloc_json_value(JSON_NUMBER);
+    val->value.number.as.real = num;
+    val->value.number.raw = NULL;
+    val->value.number.raw_length = 0;
+    return val;
+}
+
+/**
+ * Create a new JSON number value from its literal.
+ * 
+ * @param text The literal (must match the JSON number grammar)
+ * @param length Length of the literal
+ */
+JsonValue* create_json_number_text(const char* text, size_t length) {
+    JsonValue* val = alloc_json_value(JSON_NUMBER);
+    int64_t integer;
+    
+    if (json_number_convert(text, length, &val->value.number.as.real, &integer)) {
+        val->value.number.as.integer = integer;
+        val->flags |= JSON_FLAG_INTEGER;
+    }
+    
+    /* Only arena documents share the lifetime of their input */
+    if (val->flags & JSON_FLAG_ARENA) {
+        val->value.number.raw = text;
+        val->value.number.raw_length = length;
+    } else {
+        val->value.number.raw = NULL;
+        val->value.number.raw_length = 0;
+    }
     return val;
 }
 
@@ -57,9 +105,41 @@ JsonValue* create_json_number(double num) {
  * @param str The string value (will be copied)
  */
 JsonValue* create_json_string(const char* str) {
-    JsonValue* val = (JsonValue*)malloc(sizeof(JsonValue));
-    val->type = JSON_STRING;
-    val->value.string = strdup(str);
+    return create_json_string_len(str, strlen(str));
+}
+
+/**
+ * Create a new JSON string value from a length-delimited buffer.
+ * 
+ * @param str The string bytes (will be copied)
+ * @param len Number of bytes
+ */
+JsonValue* create_json_string_len(const char* str, size_t len) {
+    JsonValue* val = alloc_json_value(JSON_STRING);
+    val->value.string.data = json_strndup(str, len);
+    val->value.string.length = len;
+    return val;
+}
+
+/**
+ * Create a JSON string value for a span of parser input.
+ * Arena documents refer to the input in place; otherwise it is copied.
+ * 
+ * @param str The string bytes
+ * @param len Number of bytes
+ * @param escaped Nonzero if the bytes still contain escape sequences
+ */
+JsonValue* create_json_string_span(const char* str, size_t len, int escaped) {
+    JsonValue* val = alloc_json_value(JSON_STRING);
+    if (val->flags & JSON_FLAG_ARENA) {
+        val->value.string.data = str;
+    } else {
+        val->value.string.data = json_strndup(str, len);
+    }
+    val->value.string.length = len;
+    if (escaped) {
+        val->flags |= JSON_FLAG_ESCAPED;
+    }
     return val;
 }
 
@@ -67,9 +147,11 @@ JsonValue* create_json_string(const char* str) {
  * Create a new empty JSON array.
  */
 JsonValue* create_json_array() {
-    JsonValue* val = (JsonValue*)malloc(sizeof(JsonValue));
-    val->type = JSON_ARRAY;
-    val->value.array = NULL;
+    JsonValue* val = alloc_json_value(JSON_ARRAY);
+    val->value.array.items = NULL;
+    val->value.array.length = 0;
+    val->value.array.capacity = 0;
+    val->value.array.columns = NULL;
     return val;
 }
 
@@ -77,15 +159,45 @@ JsonValue* create_json_array() {
  * Create a new empty JSON object.
  */
 JsonValue* create_json_object() {
-    JsonValue* val = (JsonValue*)malloc(sizeof(JsonValue));
-    val->type = JSON_OBJECT;
-    val->value.object = NULL;
+    JsonValue* val = alloc_json_value(JSON_OBJECT);
+    val->value.object.members = NULL;
+    val->value.object.index = NULL;
+    val->value.object.length = 0;
+    val->value.object.capacity = 0;
+    val->value.object.shape = JSON_SHAPE_EMPTY;
     return val;
 }
 
+/**
+ * Make sure a JSON array has room for at least `capacity` elements.
+ * 
+ * @param array The JSON array to grow
+ * @param capacity The minimum number of element slots required
+ */
+void json_array_reserve(JsonValue* array, size_t capacity) {
+    if (array->type != JSON_ARRAY) return;
+    if (capacity <= array->value.array.capacity) return;
+    
+    JsonValue** items;
+    if (array->flags & JSON_FLAG_ARENA) {
+        items = (JsonValue**)json_arena_realloc(json_arena_current(), array->value.array.items,
+                                                array->value.array.capacity * sizeof(JsonValue*),
+                                                capacity * sizeof(JsonValue*));
+    } else {
+        items = (JsonValue**)realloc(array->value.array.items, capacity * sizeof(JsonValue*));
+    }
+    if (items == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    array->value.array.items = items;
+    array->value.array.capacity = capacity;
+}
+
 /**
  * Add an element to a JSON array.
- * Elements are appended to the end of the array.
+ * Elements are appended to the end of the array; the buffer doubles
+ * when full so appends are amortized O(1).
  * 
  * @param array The JSON array to add to
  * @param element The value to add
@@ -93,44 +205,202 @@ JsonValue* create_json_object() {
 void json_array_add(JsonValue* array, JsonValue* element) {
     if (array->type != JSON_ARRAY) return;
     
-    JsonArrayElement* new_elem = (JsonArrayElement*)malloc(sizeof(JsonArrayElement));
-    new_elem->value = element;
-    new_elem->next = NULL;
+    JsonArray* arr = &array->value.array;
+    if (arr->length == arr->capacity) {
+        json_array_reserve(array, arr->capacity ? arr->capacity * 2 : 4);
+    }
+    arr->items[arr->length++] = element;
+}
+
+/**
+ * Rebuild the hash index of a JSON object for its current capacity.
+ * 
+ * @param object The JSON object to index
+ */
+static void object_build_index(JsonValue* object) {
+    JsonObject* obj = &object->value.object;
+    size_t slots = obj->capacity * 2;
+    size_t mask = slots - 1;
+    size_t k;
+    uint32_t* index;
+    
+    if (object->flags & JSON_FLAG_ARENA) {
+        /* The old index is released with the arena */
+        index = (uint32_t*)json_arena_alloc(json_arena_current(), slots * sizeof(uint32_t));
+    } else {
+        free(obj->index);
+        index = (uint32_t*)malloc(slots * sizeof(uint32_t));
+    }
+    if (index == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    memset(index, 0, slots * sizeof(uint32_t));
+    
+    for (k = 0; k < obj->length; k++) {
+        size_t slot = obj->members[k].hash & mask;
+        while (index[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        index[slot] = (uint32_t)(k + 1);
+    }
+    obj->index = index;
+}
+
+/**
+ * Make sure a JSON object has room for at least `capacity` members.
+ * The capacity is rounded up to a power of two, and the hash index is
+ * rebuilt once it exceeds JSON_OBJECT_INDEX_THRESHOLD.
+ * 
+ * @param object The JSON object to grow
+ * @param capacity The minimum number of member slots required
+ */
+void json_object_reserve(JsonValue* object, size_t capacity) {
+    if (object->type != JSON_OBJECT) return;
     
-    if (array->value.array == NULL) {
-        array->value.array = new_elem;
+    JsonObject* obj = &object->value.object;
+    if (capacity <= obj->capacity) return;
+    
+    size_t new_capacity = obj->capacity ? obj->capacity : 4;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+    
+    JsonObjectMember* members;
+    if (object->flags & JSON_FLAG_ARENA) {
+        members = (JsonObjectMember*)json_arena_realloc(json_arena_current(), obj->members,
+                                                        obj->capacity * sizeof(JsonObjectMember),
+                                                        new_capacity * sizeof(JsonObjectMember));
     } else {
-        JsonArrayElement* curr = array->value.array;
-        while (curr->next != NULL) {
-            curr = curr->next;
+        members = (JsonObjectMember*)realloc(obj->members, new_capacity * sizeof(JsonObjectMember));
+    }
+    if (members == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    obj->members = members;
+    obj->capacity = (uint32_t)new_capacity;
+    
+    if (new_capacity > JSON_OBJECT_INDEX_THRESHOLD) {
+        object_build_index(object);
+    }
+}
+
+/**
+ * Find a member of a JSON object: a linear scan for small objects, a
+ * probe of the hash index for large ones. Interned keys match by pointer.
+ * 
+ * @param obj The object's members
+ * @param key The key to find
+ * @param key_length Length of the key
+ * @param hash json_hash_key() of the key
+ * @return The member, or NULL if not found
+ */
+static JsonObjectMember* object_find(const JsonObject* obj, const char* key, size_t key_length,
+                                     uint32_t hash) {
+    JsonObjectMember* member;
+    
+    if (obj->index == NULL) {
+        size_t k;
+        for (k = 0; k < obj->length; k++) {
+            member = &obj->members[k];
+            if (member->hash == hash && (member->key == key ||
+                (member->key_length == key_length && memcmp(member->key, key, key_length) == 0))) {
+                return member;
+            }
+        }
+        return NULL;
+    }
+    
+    size_t mask = obj->capacity * 2 - 1;
+    size_t slot = hash & mask;
+    uint32_t position;
+    while ((position = obj->index[slot]) != 0) {
+        member = &obj->members[position - 1];
+        if (member->hash == hash && (member->key == key ||
+            (member->key_length == key_length && memcmp(member->key, key, key_length) == 0))) {
+            return member;
         }
-        curr->next = new_elem;
+        slot = (slot + 1) & mask;
     }
+    return NULL;
 }
 
 /**
- * Add a member (key-value pair) to a JSON object using hash table.
- * UPGRADED: Uses uthash for O(1) insertion.
+ * Add a member (key-value pair) to a JSON object.
  * 
  * @param object The JSON object to add to
  * @param key The key (field name)
  * @param value The value
  */
 void json_object_add(JsonValue* object, const char* key, JsonValue* value) {
+    json_object_add_member(object, key, strlen(key), value);
+}
+
+/**
+ * Add a member whose key is given by pointer and length. The key is
+ * interned (or copied if the atom table cannot take it), so the caller
+ * keeps ownership of its buffer. A duplicate key keeps its position but
+ * takes the new value, as in jq.
+ * 
+ * @param object The JSON object to add to
+ * @param key The key
+ * @param key_length Length of the key
+ * @param value The value
+ */
+void json_object_add_member(JsonValue* object, const char* key, size_t key_length,
+                            JsonValue* value) {
     if (object->type != JSON_OBJECT) return;
     
-    JsonObjectMember* new_member = (JsonObjectMember*)malloc(sizeof(JsonObjectMember));
-    new_member->key = strdup(key);
-    new_member->value = value;
+    JsonObject* obj = &object->value.object;
+    uint32_t hash = json_hash_key(key, key_length);
+    JsonObjectMember* member = object_find(obj, key, key_length, hash);
+    
+    if (member != NULL) {
+        if (!(object->flags & JSON_FLAG_ARENA)) {
+            free_json_value(member->value);
+        }
+        member->value = value;
+        return;
+    }
+    
+    /* Only records made of interned keys are tracked by shape */
+    const char* stored_key = json_atom_intern(key, key_length, hash);
+    int key_copied = stored_key == NULL;
+    if (stored_key != NULL && obj->shape != JSON_SHAPE_NONE &&
+        obj->length < JSON_SHAPE_MAX_MEMBERS) {
+        obj->shape = json_shape_transition(obj->shape, stored_key);
+    } else {
+        obj->shape = JSON_SHAPE_NONE;
+    }
+    if (key_copied) {
+        stored_key = json_strndup(key, key_length);
+    }
+    
+    if (obj->length == obj->capacity) {
+        json_object_reserve(object, obj->length + 1);
+    }
+    
+    member = &obj->members[obj->length];
+    member->key = stored_key;
+    member->key_length = key_length;
+    member->hash = hash;
+    member->key_copied = (uint8_t)key_copied;
+    member->value = value;
     
-    /* Add to hash table using uthash */
-    HASH_ADD_KEYPTR(hh, object->value.object, new_member->key, 
-                   strlen(new_member->key), new_member);
+    if (obj->index != NULL) {
+        size_t mask = obj->capacity * 2 - 1;
+        size_t slot = hash & mask;
+        while (obj->index[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        obj->index[slot] = (uint32_t)(obj->length + 1);
+    }
+    obj->length++;
 }
 
 /**
  * Find a member in a JSON object by key.
- * UPGRADED: Uses uthash for O(1) lookup.
  * 
  * @param object The JSON object to search
  * @param key The key to find
@@ -139,90 +409,262 @@ void json_object_add(JsonValue* object, const char* key, JsonValue* value) {
 JsonValue* json_object_get(JsonValue* object, const char* key) {
     if (object->type != JSON_OBJECT) return NULL;
     
-    JsonObjectMember* member;
-    HASH_FIND_STR(object->value.object, key, member);
+    size_t key_length = strlen(key);
+    uint32_t hash = json_hash_key(key, key_length);
+    const char* atom = json_atom_find(key, key_length, hash);
+    JsonObjectMember* member = object_find(&object->value.object, atom ? atom : key,
+                                           key_length, hash);
     
     return member ? member->value : NULL;
 }
 
 /**
- * Print a JSON value to stdout with proper formatting.
- * UPGRADED: Works with hash table structure.
+ * Find a member in a JSON object by a key prepared at query compile time.
+ * If the object has the shape the key was last found in, the member is
+ * read straight from the cached position; otherwise the object is
+ * searched without hashing the key again and the cache is updated.
  * 
- * @param value The JSON value to print
- * @param indent Current indentation level (for pretty printing)
+ * @param object The JSON object to search
+ * @param key The prepared key (its inline cache may be updated)
+ * @return The value associated with the key, or NULL if not found
  */
-void print_json_value(JsonValue* value, int indent) {
+JsonValue* json_object_get_key(JsonValue* object, JsonKey* key) {
+    if (object->type != JSON_OBJECT) return NULL;
+    
+    JsonObject* obj = &object->value.object;
+    uint64_t cached = atomic_load_explicit(&key->shape_cache, memory_order_relaxed);
+    
+    if (obj->shape != JSON_SHAPE_NONE && (uint32_t)(cached >> 32) == obj->shape) {
+        if (json_shape_stats_enabled) json_shape_count_lookup(1);
+        return obj->members[(uint32_t)cached].value;
+    }
+    if (json_shape_stats_enabled) json_shape_count_lookup(0);
+    
+    JsonObjectMember* member = object_find(obj, key->atom, key->length, key->hash);
+    if (member == NULL) return NULL;
+    
+    if (obj->shape != JSON_SHAPE_NONE) {
+        atomic_store_explicit(&key->shape_cache,
+                              ((uint64_t)obj->shape << 32) | (uint64_t)(member - obj->members),
+                              memory_order_relaxed);
+    }
+    return member->value;
+}
+
+/* Re-emit parsed numbers verbatim (set once at startup, read-only after) */
+static int print_raw_numbers = 0;
+
+/**
+ * Make print_json_value() print numbers as written in the input.
+ * 
+ * @param enabled Nonzero to print the original literals
+ */
+void json_print_raw_numbers(int enabled) {
+    print_raw_numbers = enabled;
+}
+
+/* Print on one line without indentation (set once at startup) */
+static int print_compact = 0;
+
+/* Print string results unquoted (set once at startup) */
+static int print_raw_strings = 0;
+
+/**
+ * Make print_json_value() print compact, single-line JSON.
+ * 
+ * @param enabled Nonzero for compact output
+ */
+void json_print_compact(int enabled) {
+    print_compact = enabled;
+}
+
+/**
+ * Make print_json_result() print string results as raw text.
+ * 
+ * @param enabled Nonzero for raw strings
+ */
+void json_print_raw_strings(int enabled) {
+    print_raw_strings = enabled;
+}
+
+/**
+ * Print a value that is not an array or object.
+ */
+static void print_scalar(const JsonValue* value) {
+    char buffer[JSON_NUMBER_BUFFER_SIZE];
+
     if (value == NULL) {
-        printf("null");
+        JSON_OUTPUT_LITERAL("null");
         return;
     }
     
-    int i;
     switch (value->type) {
         case JSON_NULL:
-            printf("null");
+            JSON_OUTPUT_LITERAL("null");
             break;
             
         case JSON_TRUE:
-            printf("true");
+            JSON_OUTPUT_LITERAL("true");
             break;
             
         case JSON_FALSE:
-            printf("false");
+            JSON_OUTPUT_LITERAL("false");
             break;
             
         case JSON_NUMBER:
-            // Print integers without decimal point
-            if (value->value.number == (int)value->value.number) {
-                printf("%d", (int)value->value.number);
+            if (print_raw_numbers && value->value.number.raw != NULL) {
+                json_output_write(value->value.number.raw, value->value.number.raw_length);
+            } else if (value->flags & JSON_FLAG_INTEGER) {
+                json_output_write(buffer, json_number_format_int64(value->value.number.as.integer,
+                                                                   buffer));
             } else {
-                printf("%g", value->value.number);
+                json_output_write(buffer, json_number_format_double(value->value.number.as.real,
+                                                                    buffer));
             }
             break;
             
         case JSON_STRING:
-            printf("\"%s\"", value->value.string);
+            /* Escaped spans keep the escape sequences written in the input */
+            json_output_string(value->value.string.data, value->value.string.length,
+                               (value->flags & JSON_FLAG_ESCAPED) != 0);
             break;
-            
-        case JSON_ARRAY:
-            printf("[\n");
-            {
-                JsonArrayElement* elem = value->value.array;
-                int first = 1;
-                while (elem != NULL) {
-                    if (!first) printf(",\n");
-                    for (i = 0; i < indent + 2; i++) printf(" ");
-                    print_json_value(elem->value, indent + 2);
-                    elem = elem->next;
-                    first = 0;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Start a line inside a container: a newline and the indentation of
+ * `indent` spaces, or nothing when printing compact.
+ */
+static void print_line_break(int indent) {
+    if (!print_compact) {
+        json_output_char('\n');
+        json_output_indent(indent);
+    }
+}
+
+/**
+ * A container being printed by print_json_value().
+ */
+typedef struct PrintFrame {
+    const JsonValue* container;         // Array or object
+    size_t next;                        // Index of the next element or member
+} PrintFrame;
+
+#define PRINT_STACK_INLINE 64           // Levels before the stack moves to the heap
+
+/**
+ * Print a JSON value to stdout, pretty-printed with two-space indentation
+ * or compact (see json_print_compact()). Containers are walked with an
+ * explicit stack rather than recursion, so depth only costs a frame of
+ * memory per level.
+ * Output goes through the json_output buffer; call json_output_flush()
+ * before printing anything else with stdio.
+ * 
+ * @param value The JSON value to print
+ * @param indent Current indentation level (for pretty printing)
+ */
+void print_json_value(JsonValue* value, int indent) {
+    PrintFrame inline_stack[PRINT_STACK_INLINE];
+    PrintFrame* stack = inline_stack;
+    size_t capacity = PRINT_STACK_INLINE;
+    size_t depth = 0;
+    const JsonValue* current = value;
+
+    for (;;) {
+        /* Print a scalar, or open a container and descend into it */
+        if (current == NULL || (current->type != JSON_ARRAY && current->type != JSON_OBJECT)) {
+            print_scalar(current);
+        } else {
+            if (depth == capacity) {
+                PrintFrame* grown = (PrintFrame*)malloc(capacity * 2 * sizeof(PrintFrame));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Memory allocation failed\n");
+                    exit(1);
                 }
+                memcpy(grown, stack, depth * sizeof(PrintFrame));
+                if (stack != inline_stack) free(stack);
+                stack = grown;
+                capacity *= 2;
             }
-            printf("\n");
-            for (i = 0; i < indent; i++) printf(" ");
-            printf("]");
-            break;
-            
-        case JSON_OBJECT:
-            printf("{\n");
-            {
-                JsonObjectMember* member;
-                int first = 1;
-                
-                /* Iterate through hash table */
-                for (member = value->value.object; member != NULL; member = member->hh.next) {
-                    if (!first) printf(",\n");
-                    for (i = 0; i < indent + 2; i++) printf(" ");
-                    printf("\"%s\": ", member->key);
-                    print_json_value(member->value, indent + 2);
-                    first = 0;
+            stack[depth].container = current;
+            stack[depth].next = 0;
+            depth++;
+            json_output_char(current->type == JSON_ARRAY ? '[' : '{');
+            /* Pretty output keeps an empty container's line break, as before */
+            if (!print_compact && (current->type == JSON_ARRAY ? current->value.array.length
+                                                               : current->value.object.length) == 0) {
+                json_output_char('\n');
+            }
+        }
+
+        /* Move on to the next element, closing the containers that are done */
+        current = NULL;
+        while (depth > 0) {
+            PrintFrame* frame = &stack[depth - 1];
+            const JsonValue* container = frame->container;
+            int level = indent + 2 * (int)depth;
+
+            if (container->type == JSON_ARRAY && frame->next < container->value.array.length) {
+                if (frame->next > 0) json_output_char(',');
+                print_line_break(level);
+                current = container->value.array.items[frame->next++];
+                break;
+            }
+            if (container->type == JSON_OBJECT && frame->next < container->value.object.length) {
+                const JsonObjectMember* member = &container->value.object.members[frame->next++];
+                if (frame->next > 1) json_output_char(',');
+                print_line_break(level);
+                json_output_string(member->key, member->key_length, 0);
+                if (print_compact) {
+                    json_output_char(':');
+                } else {
+                    JSON_OUTPUT_LITERAL(": ");
                 }
+                current = member->value;
+                break;
             }
-            printf("\n");
-            for (i = 0; i < indent; i++) printf(" ");
-            printf("}");
-            break;
+
+            print_line_break(level - 2);
+            json_output_char(container->type == JSON_ARRAY ? ']' : '}');
+            depth--;
+        }
+        if (depth == 0) break;
+    }
+
+    if (stack != inline_stack) free(stack);
+}
+
+/**
+ * Print a query result: like print_json_value(), except that with
+ * json_print_raw_strings() a string result is printed as its decoded
+ * text, without quotes.
+ *
+ * @param value The result
+ * @param indent Current indentation level
+ */
+void print_json_result(JsonValue* value, int indent) {
+    if (!print_raw_strings || value == NULL || value->type != JSON_STRING) {
+        print_json_value(value, indent);
+        return;
+    }
+
+    if (!(value->flags & JSON_FLAG_ESCAPED)) {
+        json_output_write(value->value.string.data, value->value.string.length);
+        return;
     }
+
+    /* Decoding never makes the text longer */
+    char* text = (char*)malloc(value->value.string.length + 1);
+    if (text == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    json_output_write(text, json_unescape(value->value.string.data,
+                                          value->value.string.length, text));
+    free(text);
 }
 
 /**
@@ -251,30 +693,38 @@ static JsonValue* clone_json_value_internal(JsonValue* value) {
         case JSON_FALSE:
             return create_json_bool(0);
             
-        case JSON_NUMBER:
-            return create_json_number(value->value.number);
+        case JSON_NUMBER: {
+            JsonValue* new_number = create_json_number(0);
+            new_number->value.number.as = value->value.number.as;
+            new_number->flags |= value->flags & JSON_FLAG_INTEGER;
+            return new_number;
+        }
             
-        case JSON_STRING:
-            return create_json_string(value->value.string);
+        case JSON_STRING: {
+            JsonValue* new_string = create_json_string_len(value->value.string.data,
+                                                           value->value.string.length);
+            new_string->flags |= value->flags & JSON_FLAG_ESCAPED;
+            return new_string;
+        }
             
         case JSON_ARRAY: {
             JsonValue* new_array = create_json_array();
-            JsonArrayElement* elem = value->value.array;
-            while (elem != NULL) {
-                json_array_add(new_array, clone_json_value_internal(elem->value));
-                elem = elem->next;
+            size_t k;
+            json_array_reserve(new_array, value->value.array.length);
+            for (k = 0; k < value->value.array.length; k++) {
+                json_array_add(new_array, clone_json_value_internal(value->value.array.items[k]));
             }
             return new_array;
         }
         
         case JSON_OBJECT: {
             JsonValue* new_object = create_json_object();
-            JsonObjectMember* member;
-            
-            /* Iterate through hash table */
-            for (member = value->value.object; member != NULL; member = member->hh.next) {
-                json_object_add(new_object, member->key, 
-                              clone_json_value_internal(member->value));
+            size_t k;
+            json_object_reserve(new_object, value->value.object.length);
+            for (k = 0; k < value->value.object.length; k++) {
+                JsonObjectMember* member = &value->value.object.members[k];
+                json_object_add_member(new_object, member->key, member->key_length,
+                                       clone_json_value_internal(member->value));
             }
             return new_object;
         }
@@ -284,42 +734,53 @@ static JsonValue* clone_json_value_internal(JsonValue* value) {
 }
 
 /**
- * Free memory allocated for a JSON value and all its children.
- * UPGRADED: Properly frees hash table.
+ * Drop a reference to a JSON value. The last reference frees the value
+ * and releases its children.
  * 
- * @param value The JSON value to free
+ * @param value The JSON value to release
  */
 void free_json_value(JsonValue* value) {
     if (value == NULL) return;
     
+    /* Arena trees are released all at once by json_arena_destroy() */
+    if (value->flags & JSON_FLAG_ARENA) return;
+    
+    if (atomic_fetch_sub_explicit(&value->refcount, 1, memory_order_acq_rel) != 1) return;
+    
     switch (value->type) {
         case JSON_STRING:
-            free(value->value.string);
+            free((char*)value->value.string.data);
             break;
             
         case JSON_ARRAY:
             {
-                JsonArrayElement* elem = value->value.array;
-                while (elem != NULL) {
-                    JsonArrayElement* next = elem->next;
-                    free_json_value(elem->value);
-                    free(elem);
-                    elem = next;
+                size_t k;
+                JsonColumn* column = value->value.array.columns;
+                for (k = 0; k < value->value.array.length; k++) {
+                    free_json_value(value->value.array.items[k]);
+                }
+                free(value->value.array.items);
+                while (column != NULL) {
+                    JsonColumn* next = column->next;
+                    free(column->types);
+                    free(column->numbers);
+                    free(column);
+                    column = next;
                 }
             }
             break;
             
         case JSON_OBJECT:
             {
-                JsonObjectMember* member, *tmp;
-                
-                /* Delete all items from hash table */
-                HASH_ITER(hh, value->value.object, member, tmp) {
-                    HASH_DEL(value->value.object, member);
-                    free(member->key);
-                    free_json_value(member->value);
-                    free(member);
+                size_t k;
+                for (k = 0; k < value->value.object.length; k++) {
+                    if (value->value.object.members[k].key_copied) {
+                        free((char*)value->value.object.members[k].key);
+                    }
+                    free_json_value(value->value.object.members[k].value);
                 }
+                free(value->value.object.members);
+                free(value->value.object.index);
             }
             break;
             
@@ -331,27 +792,165 @@ void free_json_value(JsonValue* value) {
 }
 
 /**
- * Evaluate a condition expression on a JSON value.
- * Used by select() filtering.
+ * Add a reference to a JSON value.
+ * 
+ * @param value The value (may be NULL)
+ * @return The value
+ */
+JsonValue* json_value_retain(JsonValue* value) {
+    if (value != NULL && !(value->flags & JSON_FLAG_ARENA)) {
+        atomic_fetch_add_explicit(&value->refcount, 1, memory_order_relaxed);
+    }
+    return value;
+}
+
+/**
+ * A child for a container copied by json_value_unshare(): heap children
+ * are shared with a new reference, while arena children are deep-copied
+ * to the heap, since the arena goes away with its document.
+ */
+static JsonValue* unshare_child(JsonValue* child) {
+    if (child != NULL && (child->flags & JSON_FLAG_ARENA)) {
+        return clone_json_value_internal(child);
+    }
+    return json_value_retain(child);
+}
+
+/**
+ * Copy on write: get a version of a value that may be modified in place.
+ * A heap value the caller holds the only reference to is returned as is.
+ * Anything else (including arena values, which belong to their document)
+ * is replaced by a heap copy one level deep: a container's copy shares
+ * its heap children, so unsharing a nested value only copies the path
+ * down to it, and deep-copies the children that live in an arena. The
+ * caller's reference to the original is dropped.
+ * 
+ * @param value The value; the caller's reference is taken over
+ * @return A heap value the caller holds the only reference to
+ */
+JsonValue* json_value_unshare(JsonValue* value) {
+    JsonArena* arena;
+    JsonValue* copy;
+    size_t k;
+    
+    if (value == NULL) return NULL;
+    if (!(value->flags & JSON_FLAG_ARENA) &&
+        atomic_load_explicit(&value->refcount, memory_order_acquire) == 1) {
+        return value;
+    }
+    
+    /* The copy outlives any arena the original came from */
+    arena = json_arena_current();
+    json_arena_set_current(NULL);
+    switch (value->type) {
+        case JSON_ARRAY:
+            copy = create_json_array();
+            json_array_reserve(copy, value->value.array.length);
+            for (k = 0; k < value->value.array.length; k++) {
+                json_array_add(copy, unshare_child(value->value.array.items[k]));
+            }
+            break;
+            
+        case JSON_OBJECT:
+            copy = create_json_object();
+            json_object_reserve(copy, value->value.object.length);
+            for (k = 0; k < value->value.object.length; k++) {
+                JsonObjectMember* member = &value->value.object.members[k];
+                json_object_add_member(copy, member->key, member->key_length,
+                                       unshare_child(member->value));
+            }
+            break;
+            
+        default:
+            copy = clone_json_value_internal(value);
+            break;
+    }
+    json_arena_set_current(arena);
+    
+    free_json_value(value);
+    return copy;
+}
+
+/* ---- Bytecode ---- */
+
+/**
+ * Instructions of a compiled query. A program is the query's chain of
+ * operations laid out flat, pipes included, and ends in OP_RETURN. The
+ * operations after a .[] form a body that runs once per element; it
+ * follows its OP_MAP and ends in its own OP_RETURN. The left-hand side of
+ * each select() condition is a body placed after the main program.
+ */
+typedef enum {
+    OP_FIELD,       // Replace the object by one of its fields
+    OP_INDEX,       // Replace the array by one of its elements
+    OP_SLICE,       // Keep a range of the array's elements
+    OP_SELECT,      // Keep the array elements that pass a condition
+    OP_ITERATE,     // .[] ending a chain: the array itself
+    OP_MAP,         // .[] followed by more: run the body on each element
+    OP_RETURN       // End of the program or of a body
+} OpCode;
+
+/**
+ * One instruction with its operands inline.
+ */
+typedef struct Instruction {
+    OpCode op;
+    union {
+        JsonKey* key;                   // OP_FIELD: the query node's key and inline cache
+        struct {
+            int position;               // Element to access
+            int written;                // Index to report in errors
+            int sliced;                 // Folded from a slice: report as one
+        } index;                        // OP_INDEX
+        struct {
+            int start;
+            int end;                    // -1 for the end of the array
+        } slice;                        // OP_SLICE
+        struct {
+            ConditionExpr* condition;
+            uint32_t left;              // First instruction of the left-hand side
+        } select;                       // OP_SELECT
+        uint32_t target;                // OP_MAP: first instruction after the body
+    } operand;
+} Instruction;
+
+/**
+ * A compiled query (see compile_query()).
+ */
+struct QueryProgram {
+    Instruction* code;
+    size_t length;
+    size_t capacity;
+};
+
+static JsonValue* run_subprogram(const QueryProgram* program, uint32_t pc, JsonValue* data);
+
+/**
+ * Evaluate a select() condition on a JSON value.
  * 
- * @param condition The condition to evaluate
+ * @param program The compiled query
+ * @param select The OP_SELECT instruction
  * @param item The JSON value to test
  * @return 1 if condition is true, 0 otherwise
  */
-static int evaluate_condition(ConditionExpr* condition, JsonValue* item) {
+static int evaluate_condition(const QueryProgram* program, const Instruction* select,
+                              JsonValue* item) {
+    ConditionExpr* condition = select->operand.select.condition;
     if (condition == NULL || item == NULL) return 0;
     
     /* Execute the left-hand side query (usually a field access) */
-    JsonValue* result = execute_query_internal(condition->left, item);
+    JsonValue* result = run_subprogram(program, select->operand.select.left, item);
     if (result == NULL) return 0;
     
     /* Only numbers are supported in comparisons for now */
     if (result->type != JSON_NUMBER) {
+        free_json_value(result);
         return 0;
     }
     
-    double left_val = result->value.number;
+    double left_val = json_number_value(result);
     double right_val = condition->value;
+    free_json_value(result);
     
     /* Perform comparison */
     switch (condition->op) {
@@ -366,187 +965,1306 @@ static int evaluate_condition(ConditionExpr* condition, JsonValue* item) {
 }
 
 /**
- * Internal query execution function (recursive for pipes).
+ * Find the column the parser built for the field a select() condition
+ * tests, if the array has one.
  * 
- * @param query The query AST
- * @param json_data The JSON data to query
- * @return The result of the query
+ * @param array The array being filtered
+ * @param condition The select() condition
+ * @return The column, or NULL to evaluate the condition element by element
  */
-static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data) {
-    if (json_data == NULL) {
-        return NULL;
+static const JsonColumn* find_condition_column(const JsonValue* array,
+                                               const ConditionExpr* condition) {
+    const QueryNode* left = condition->left;
+    const JsonColumn* column;
+    
+    if (left == NULL || left->type != QUERY_FIELD || left->next != NULL) return NULL;
+    
+    for (column = array->value.array.columns; column != NULL; column = column->next) {
+        if (column->key == left->data.field.atom &&
+            column->length == array->value.array.length) {
+            return column;
+        }
     }
+    return NULL;
+}
+
+/**
+ * Gather the field a select() condition tests from every element of an
+ * array into a temporary column, for arrays the parser did not build one
+ * for. Elements that are not objects or lack the field become
+ * JSON_COLUMN_MISSING rows.
+ * 
+ * @param array The array being filtered
+ * @param condition The select() condition
+ * @param column Receives the rows (free types and numbers when done)
+ * @return 1 if the column was filled, 0 if the condition does not test a
+ *         plain field
+ */
+static int gather_condition_column(const JsonValue* array, ConditionExpr* condition,
+                                   JsonColumn* column) {
+    QueryNode* left = condition->left;
+    size_t length = array->value.array.length;
+    size_t k;
+    
+    if (left == NULL || left->type != QUERY_FIELD || left->next != NULL) return 0;
     
-    if (query == NULL) {
-        return json_data;
+    column->key = left->data.field.atom;
+    column->types = (unsigned char*)malloc(length ? length : 1);
+    column->numbers = (double*)malloc((length ? length : 1) * sizeof(double));
+    if (column->types == NULL || column->numbers == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
     }
+    column->length = length;
+    column->capacity = length;
+    column->next = NULL;
     
-    switch (query->type) {
-        case QUERY_IDENTITY:
-            /* Identity: return current value and continue */
-            return execute_query_internal(query->next, json_data);
-            
-        case QUERY_FIELD: {
-            /* Field access: look up a key in an object */
-            if (json_data->type != JSON_OBJECT) {
-                fprintf(stderr, "Error: Cannot access field '%s' on non-object\n", 
-                        query->data.field);
-                return NULL;
-            }
-            
-            /* Use hash table lookup (O(1)) */
-            JsonValue* result = json_object_get(json_data, query->data.field);
-            if (result == NULL) {
-                fprintf(stderr, "Error: Field '%s' not found in object\n", 
-                        query->data.field);
-                return NULL;
-            }
-            
-            return execute_query_internal(query->next, result);
+    for (k = 0; k < length; k++) {
+        JsonValue* item = array->value.array.items[k];
+        JsonValue* value = item != NULL && item->type == JSON_OBJECT
+                         ? json_object_get_key(item, &left->data.field) : NULL;
+        if (value == NULL) {
+            column->types[k] = JSON_COLUMN_MISSING;
+            column->numbers[k] = 0;
+        } else {
+            column->types[k] = (unsigned char)value->type;
+            column->numbers[k] = value->type == JSON_NUMBER ? json_number_value(value) : 0;
         }
-        
-        case QUERY_INDEX: {
-            /* Array index: access an element by index */
-            if (json_data->type != JSON_ARRAY) {
-                fprintf(stderr, "Error: Cannot index non-array with [%d]\n", 
-                        query->data.index);
-                return NULL;
-            }
-            
-            JsonArrayElement* elem = json_data->value.array;
-            int idx = 0;
-            
-            while (elem != NULL) {
-                if (idx == query->data.index) {
-                    return execute_query_internal(query->next, elem->value);
-                }
-                elem = elem->next;
-                idx++;
-            }
-            
-            fprintf(stderr, "Error: Array index %d out of bounds\n", query->data.index);
-            return NULL;
+    }
+    return 1;
+}
+
+/**
+ * Produces the elements of an array one at a time.
+ * .[], select() and slices are generators pulling from the stage before
+ * them, so a pipeline hands values through one by one instead of building
+ * an array per stage, and stops computing as soon as its consumer stops
+ * asking (e.g. `select(...) | [0]` ends at the first match).
+ */
+typedef struct Generator Generator;
+struct Generator {
+    /* Produce the next element as a new reference; return 0 at the end */
+    int (*next)(Generator* generator, JsonValue** element);
+    /* Free the generator and everything it still holds */
+    void (*destroy)(Generator* generator);
+};
+
+/**
+ * Result of a query stage: a value, or an array produced on demand.
+ * Both are NULL after an error.
+ */
+typedef struct StageResult {
+    JsonValue* value;                   // The result (a reference owned by the holder)
+    Generator* elements;                // Lazy array result when value is NULL
+} StageResult;
+
+/**
+ * Public handle on a query result (see execute_query_stream()).
+ */
+struct JsonStream {
+    StageResult result;
+    QueryProgram* program;              // Program compiled for this stream, or NULL
+};
+
+static StageResult run_program(const QueryProgram* program, uint32_t pc, StageResult input);
+
+/**
+ * Allocate a generator of the given size and fill in its methods.
+ */
+static void* generator_create(size_t size, int (*next)(Generator*, JsonValue**),
+                              void (*destroy)(Generator*)) {
+    Generator* generator = (Generator*)malloc(size);
+    if (generator == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    generator->next = next;
+    generator->destroy = destroy;
+    return generator;
+}
+
+/**
+ * Make a stage result holding a value (its reference is taken over).
+ */
+static StageResult stage_value(JsonValue* value) {
+    StageResult result = { value, NULL };
+    return result;
+}
+
+/**
+ * Make a stage result holding a lazy array.
+ */
+static StageResult stage_elements(Generator* elements) {
+    StageResult result = { NULL, elements };
+    return result;
+}
+
+/**
+ * Check whether a stage result is an array (lazy or not).
+ */
+static int stage_is_array(StageResult result) {
+    return result.elements != NULL ||
+           (result.value != NULL && result.value->type == JSON_ARRAY);
+}
+
+/**
+ * Drop a stage result, including the elements it has not produced yet.
+ */
+static void stage_release(StageResult result) {
+    free_json_value(result.value);
+    if (result.elements != NULL) {
+        result.elements->destroy(result.elements);
+    }
+}
+
+/**
+ * Turn a stage result into a value, running its generator to the end.
+ *
+ * @param result The stage result (taken over)
+ * @return A new reference to the value, or NULL after an error
+ */
+static JsonValue* stage_collect(StageResult result) {
+    JsonValue* array;
+    JsonValue* element;
+
+    if (result.elements == NULL) {
+        return result.value;
+    }
+
+    array = create_json_array();
+    while (result.elements->next(result.elements, &element)) {
+        json_array_add(array, element);
+    }
+    result.elements->destroy(result.elements);
+    return array;
+}
+
+/* ---- Generators ---- */
+
+/**
+ * Elements [position, end) of a materialized array.
+ */
+typedef struct ArrayGenerator {
+    Generator base;
+    JsonValue* array;                   // The array (a reference held by the generator)
+    size_t position;                    // Next element
+    size_t end;                         // One past the last element
+} ArrayGenerator;
+
+static int array_generator_next(Generator* generator, JsonValue** element) {
+    ArrayGenerator* self = (ArrayGenerator*)generator;
+    if (self->position >= self->end) return 0;
+    *element = json_value_retain(self->array->value.array.items[self->position++]);
+    return 1;
+}
+
+static void array_generator_destroy(Generator* generator) {
+    ArrayGenerator* self = (ArrayGenerator*)generator;
+    free_json_value(self->array);
+    free(self);
+}
+
+/**
+ * Generate a range of an array's elements.
+ *
+ * @param array The array (its reference is taken over)
+ * @param start First element
+ * @param end One past the last element (clamped to the length)
+ */
+static Generator* array_generator_create(JsonValue* array, size_t start, size_t end) {
+    ArrayGenerator* self = (ArrayGenerator*)generator_create(sizeof(ArrayGenerator),
+                                                             array_generator_next,
+                                                             array_generator_destroy);
+    self->array = array;
+    self->end = end < array->value.array.length ? end : array->value.array.length;
+    self->position = start < self->end ? start : self->end;
+    return &self->base;
+}
+
+/**
+ * Get the elements of an array stage result as a generator.
+ */
+static Generator* stage_generator(StageResult result) {
+    if (result.elements != NULL) {
+        return result.elements;
+    }
+    return array_generator_create(result.value, 0, result.value->value.array.length);
+}
+
+/**
+ * Elements [start, end) of a lazy array.
+ */
+typedef struct SliceGenerator {
+    Generator base;
+    Generator* upstream;
+    long skip;                          // Elements still to drop before the range
+    long remaining;                     // Elements left in the range, or -1 for no limit
+} SliceGenerator;
+
+static int slice_generator_next(Generator* generator, JsonValue** element) {
+    SliceGenerator* self = (SliceGenerator*)generator;
+
+    while (self->skip > 0) {
+        if (!self->upstream->next(self->upstream, element)) return 0;
+        free_json_value(*element);
+        self->skip--;
+    }
+    if (self->remaining == 0 || !self->upstream->next(self->upstream, element)) return 0;
+    if (self->remaining > 0) self->remaining--;
+    return 1;
+}
+
+static void slice_generator_destroy(Generator* generator) {
+    SliceGenerator* self = (SliceGenerator*)generator;
+    self->upstream->destroy(self->upstream);
+    free(self);
+}
+
+/**
+ * select() over a lazy array: the condition is evaluated per element as
+ * elements are pulled.
+ */
+typedef struct FilterGenerator {
+    Generator base;
+    Generator* upstream;
+    const QueryProgram* program;
+    const Instruction* select;          // The OP_SELECT instruction
+} FilterGenerator;
+
+static int filter_generator_next(Generator* generator, JsonValue** element) {
+    FilterGenerator* self = (FilterGenerator*)generator;
+
+    while (self->upstream->next(self->upstream, element)) {
+        if (evaluate_condition(self->program, self->select, *element)) return 1;
+        free_json_value(*element);
+    }
+    return 0;
+}
+
+static void filter_generator_destroy(Generator* generator) {
+    FilterGenerator* self = (FilterGenerator*)generator;
+    self->upstream->destroy(self->upstream);
+    free(self);
+}
+
+/**
+ * select() over a materialized array through a column of the tested
+ * field: the comparison runs over all rows at once into a selection
+ * bitmap (see json_filter.h), and elements are produced from its set bits.
+ * Rows whose element is not an object or lacks the field go through
+ * evaluate_condition() when reached, which reports the error as before;
+ * other non-number rows never match.
+ */
+typedef struct BitmapGenerator {
+    Generator base;
+    JsonValue* array;                   // The array (a reference held by the generator)
+    const QueryProgram* program;
+    const Instruction* select;          // The OP_SELECT instruction
+    uint64_t* selection;                // Rows that pass
+    uint64_t* missing;                  // Rows without the field, or NULL if there are none
+    size_t words;                       // Words in each bitmap
+    size_t word;                        // Word being scanned
+    uint64_t bits;                      // Rows of that word still to visit
+} BitmapGenerator;
+
+static int bitmap_generator_next(Generator* generator, JsonValue** element) {
+    BitmapGenerator* self = (BitmapGenerator*)generator;
+
+    for (;;) {
+        while (self->bits == 0) {
+            if (++self->word >= self->words) return 0;
+            self->bits = self->selection[self->word] |
+                         (self->missing ? self->missing[self->word] : 0);
         }
-        
-        case QUERY_SLICE: {
-            /* Array slice: return a sub-array */
-            if (json_data->type != JSON_ARRAY) {
+
+        unsigned bit = (unsigned)__builtin_ctzll(self->bits);
+        JsonValue* item = self->array->value.array.items[self->word * 64 + bit];
+        self->bits &= self->bits - 1;
+        if (((self->selection[self->word] >> bit) & 1) ||
+            evaluate_condition(self->program, self->select, item)) {
+            *element = json_value_retain(item);
+            return 1;
+        }
+    }
+}
+
+static void bitmap_generator_destroy(Generator* generator) {
+    BitmapGenerator* self = (BitmapGenerator*)generator;
+    free_json_value(self->array);
+    free(self->selection);
+    free(self->missing);
+    free(self);
+}
+
+/**
+ * Start a bitmap select() over a column, one row per element of array.
+ *
+ * @param column The column of the tested field
+ * @param array The array (its reference is taken over)
+ * @param program The compiled query
+ * @param select The OP_SELECT instruction
+ */
+static Generator* bitmap_generator_create(const JsonColumn* column, JsonValue* array,
+                                          const QueryProgram* program,
+                                          const Instruction* select) {
+    ConditionExpr* condition = select->operand.select.condition;
+    BitmapGenerator* self = (BitmapGenerator*)generator_create(sizeof(BitmapGenerator),
+                                                               bitmap_generator_next,
+                                                               bitmap_generator_destroy);
+    size_t words = JSON_FILTER_WORDS(column->length);
+    uint64_t* mask = (uint64_t*)malloc((words ? words : 1) * sizeof(uint64_t));
+    uint64_t any_missing = 0;
+    size_t w;
+
+    self->selection = (uint64_t*)malloc((words ? words : 1) * sizeof(uint64_t));
+    if (self->selection == NULL || mask == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+
+    json_filter_compare(condition->op, column->numbers, column->length,
+                        condition->value, self->selection);
+    json_filter_type_mask(column->types, column->length, JSON_NUMBER, mask);
+    for (w = 0; w < words; w++) {
+        self->selection[w] &= mask[w];
+    }
+    json_filter_type_mask(column->types, column->length, JSON_COLUMN_MISSING, mask);
+    for (w = 0; w < words; w++) {
+        any_missing |= mask[w];
+    }
+    if (!any_missing) {
+        free(mask);
+        mask = NULL;
+    }
+
+    self->array = array;
+    self->program = program;
+    self->select = select;
+    self->missing = mask;
+    self->words = words;
+    self->word = 0;
+    self->bits = words > 0 ? self->selection[0] | (mask ? mask[0] : 0) : 0;
+    return &self->base;
+}
+
+/**
+ * .[] followed by more operations: the rest of the query runs on each
+ * element as it is pulled. Elements on which it fails are skipped.
+ */
+typedef struct MapGenerator {
+    Generator base;
+    Generator* upstream;
+    const QueryProgram* program;
+    uint32_t body;                      // First instruction of the operations after .[]
+} MapGenerator;
+
+static int map_generator_next(Generator* generator, JsonValue** element) {
+    MapGenerator* self = (MapGenerator*)generator;
+    JsonValue* item;
+
+    while (self->upstream->next(self->upstream, &item)) {
+        *element = stage_collect(run_program(self->program, self->body, stage_value(item)));
+        if (*element != NULL) return 1;
+    }
+    return 0;
+}
+
+static void map_generator_destroy(Generator* generator) {
+    MapGenerator* self = (MapGenerator*)generator;
+    self->upstream->destroy(self->upstream);
+    free(self);
+}
+
+/* ---- Stages ---- */
+
+/**
+ * Apply a slice to an array stage result.
+ */
+static StageResult run_slice(const Instruction* instruction, StageResult input) {
+    long start = instruction->operand.slice.start;
+    long end = instruction->operand.slice.end;
+
+    if (start < 0) {
+        start = 0;
+    }
+
+    if (input.value != NULL) {
+        /* An end of -1 means slice to the end of the array */
+        size_t stop = end == -1 ? input.value->value.array.length : (size_t)(end < 0 ? 0 : end);
+        return stage_elements(array_generator_create(input.value, (size_t)start, stop));
+    }
+
+    SliceGenerator* self = (SliceGenerator*)generator_create(sizeof(SliceGenerator),
+                                                             slice_generator_next,
+                                                             slice_generator_destroy);
+    self->upstream = input.elements;
+    self->skip = start;
+    self->remaining = end == -1 ? -1 : (end > start ? end - start : 0);
+    return stage_elements(&self->base);
+}
+
+/**
+ * Apply select() to an array stage result.
+ */
+static StageResult run_select(const QueryProgram* program, const Instruction* instruction,
+                              StageResult input) {
+    ConditionExpr* condition = instruction->operand.select.condition;
+
+    if (input.value != NULL) {
+        const JsonColumn* column = find_condition_column(input.value, condition);
+        JsonColumn gathered;
+        Generator* elements;
+
+        if (column != NULL) {
+            /* Scan the column the parser built instead of every record */
+            return stage_elements(bitmap_generator_create(column, input.value,
+                                                          program, instruction));
+        }
+        if (gather_condition_column(input.value, condition, &gathered)) {
+            elements = bitmap_generator_create(&gathered, input.value, program, instruction);
+            free(gathered.types);
+            free(gathered.numbers);
+            return stage_elements(elements);
+        }
+    }
+
+    FilterGenerator* self = (FilterGenerator*)generator_create(sizeof(FilterGenerator),
+                                                               filter_generator_next,
+                                                               filter_generator_destroy);
+    self->upstream = stage_generator(input);
+    self->program = program;
+    self->select = instruction;
+    return stage_elements(&self->base);
+}
+
+/* ---- Interpreter ---- */
+
+/*
+ * With GCC and Clang each instruction jumps straight to the handler of the
+ * next one through a table of label addresses ("computed goto"), so every
+ * handler ends in its own indirect branch instead of sharing the one at
+ * the top of a switch. Other compilers (or -DJSON_NO_COMPUTED_GOTO) get
+ * the switch.
+ */
+#if defined(__GNUC__) && !defined(JSON_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO 1
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#define TARGET(op) target_##op:
+#define DISPATCH() goto *dispatch_table[program->code[pc].op]
+#else
+#define TARGET(op) case op:
+#define DISPATCH() goto dispatch
+#endif
+
+/**
+ * Run a program, or one of its bodies, on a stage result.
+ * The loop only nests for .[] bodies, which run from their generator.
+ *
+ * @param program The compiled query
+ * @param pc First instruction to run
+ * @param input The data to query (taken over)
+ * @return The result; both fields are NULL on error
+ */
+static StageResult run_program(const QueryProgram* program, uint32_t pc, StageResult input) {
+    StageResult current = input;
+    StageResult failed = { NULL, NULL };
+    const Instruction* instruction;
+
+#ifdef VM_COMPUTED_GOTO
+    static const void* const dispatch_table[] = {
+        [OP_FIELD] = &&target_OP_FIELD,
+        [OP_INDEX] = &&target_OP_INDEX,
+        [OP_SLICE] = &&target_OP_SLICE,
+        [OP_SELECT] = &&target_OP_SELECT,
+        [OP_ITERATE] = &&target_OP_ITERATE,
+        [OP_MAP] = &&target_OP_MAP,
+        [OP_RETURN] = &&target_OP_RETURN,
+    };
+#endif
+
+    if (current.value == NULL && current.elements == NULL) {
+        return failed;
+    }
+
+#ifdef VM_COMPUTED_GOTO
+    DISPATCH();
+#else
+dispatch:
+    switch (program->code[pc].op) {
+#endif
+
+    TARGET(OP_FIELD) {
+        /* Field access: look up a key in an object */
+        instruction = &program->code[pc];
+        if (current.value == NULL || current.value->type != JSON_OBJECT) {
+            fprintf(stderr, "Error: Cannot access field '%s' on non-object\n",
+                    instruction->operand.key->name);
+            goto error;
+        }
+
+        /* Length, hash and atom were computed when the query was parsed */
+        JsonValue* result = json_object_get_key(current.value, instruction->operand.key);
+        if (result == NULL) {
+            fprintf(stderr, "Error: Field '%s' not found in object\n",
+                    instruction->operand.key->name);
+            goto error;
+        }
+
+        json_value_retain(result);
+        stage_release(current);
+        current = stage_value(result);
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(OP_INDEX) {
+        /* Array index: access an element by index */
+        instruction = &program->code[pc];
+        int idx = instruction->operand.index.position;
+        JsonValue* result = NULL;
+
+        if (!stage_is_array(current)) {
+            if (instruction->operand.index.sliced) {
                 fprintf(stderr, "Error: Cannot slice non-array\n");
-                return NULL;
+            } else {
+                fprintf(stderr, "Error: Cannot index non-array with [%d]\n", idx);
             }
-            
-            JsonValue* result_array = create_json_array();
-            JsonArrayElement* elem = json_data->value.array;
-            int idx = 0;
-            int start = query->data.slice.start;
-            int end = query->data.slice.end;
-            
-            /* Count array length if end is -1 (slice to end) */
-            if (end == -1) {
-                JsonArrayElement* temp = elem;
-                end = 0;
-                while (temp != NULL) {
-                    end++;
-                    temp = temp->next;
-                }
+            goto error;
+        }
+
+        if (current.value != NULL) {
+            /* Direct O(1) access into the element buffer */
+            if (idx >= 0 && (size_t)idx < current.value->value.array.length) {
+                result = json_value_retain(current.value->value.array.items[idx]);
             }
-            
-            /* Collect elements in range [start, end) */
-            while (elem != NULL && idx < end) {
-                if (idx >= start) {
-                    json_array_add(result_array, clone_json_value_internal(elem->value));
+        } else if (idx >= 0) {
+            /* Pull up to the element; the rest is never computed */
+            JsonValue* element;
+            int k;
+            for (k = 0; k <= idx && current.elements->next(current.elements, &element); k++) {
+                if (k == idx) {
+                    result = element;
+                } else {
+                    free_json_value(element);
                 }
-                elem = elem->next;
-                idx++;
             }
-            
-            return execute_query_internal(query->next, result_array);
         }
-        
-        case QUERY_ARRAY_ITER: {
-            /* Array iteration: .[] - return array as-is for further processing */
-            if (json_data->type != JSON_ARRAY) {
-                fprintf(stderr, "Error: Cannot iterate over non-array\n");
-                return NULL;
-            }
-            
-            /* If there's a next operation, apply it to each element */
-            if (query->next != NULL) {
-                JsonValue* result_array = create_json_array();
-                JsonArrayElement* elem = json_data->value.array;
-                
-                while (elem != NULL) {
-                    JsonValue* item_result = execute_query_internal(query->next, elem->value);
-                    if (item_result != NULL) {
-                        json_array_add(result_array, item_result);
-                    }
-                    elem = elem->next;
+
+        if (result == NULL) {
+            fprintf(stderr, "Error: Array index %d out of bounds\n",
+                    instruction->operand.index.written);
+            goto error;
+        }
+        stage_release(current);
+        current = stage_value(result);
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(OP_SLICE) {
+        /* Array slice: produce a range of the elements */
+        if (!stage_is_array(current)) {
+            fprintf(stderr, "Error: Cannot slice non-array\n");
+            goto error;
+        }
+        current = run_slice(&program->code[pc], current);
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(OP_SELECT) {
+        /* Filter array elements with select() */
+        if (!stage_is_array(current)) {
+            fprintf(stderr, "Error: select() can only be applied to arrays\n");
+            goto error;
+        }
+        current = run_select(program, &program->code[pc], current);
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(OP_ITERATE) {
+        /* .[] with nothing after it: the array itself */
+        if (!stage_is_array(current)) {
+            fprintf(stderr, "Error: Cannot iterate over non-array\n");
+            goto error;
+        }
+        pc++;
+        DISPATCH();
+    }
+
+    TARGET(OP_MAP) {
+        /* .[] followed by more operations: run the body on each element */
+        instruction = &program->code[pc];
+        if (!stage_is_array(current)) {
+            fprintf(stderr, "Error: Cannot iterate over non-array\n");
+            goto error;
+        }
+
+        MapGenerator* self = (MapGenerator*)generator_create(sizeof(MapGenerator),
+                                                             map_generator_next,
+                                                             map_generator_destroy);
+        self->upstream = stage_generator(current);
+        self->program = program;
+        self->body = pc + 1;
+        current = stage_elements(&self->base);
+        pc = instruction->operand.target;
+        DISPATCH();
+    }
+
+    TARGET(OP_RETURN) {
+        return current;
+    }
+
+#ifndef VM_COMPUTED_GOTO
+    }
+    fprintf(stderr, "Error: Unknown query operation type\n");
+#endif
+
+error:
+    stage_release(current);
+    return failed;
+}
+
+#undef TARGET
+#undef DISPATCH
+
+/**
+ * Run a program body on a value and collect the result.
+ *
+ * @param program The compiled query
+ * @param pc First instruction of the body
+ * @param data The value to query (borrowed)
+ * @return A new reference to the result, or NULL on error
+ */
+static JsonValue* run_subprogram(const QueryProgram* program, uint32_t pc, JsonValue* data) {
+    return stage_collect(run_program(program, pc, stage_value(json_value_retain(data))));
+}
+
+/* ---- Compiler ---- */
+
+/**
+ * Append an instruction to a program.
+ *
+ * @return The index of the new instruction
+ */
+static uint32_t emit(QueryProgram* program, OpCode op) {
+    if (program->length == program->capacity) {
+        size_t capacity = program->capacity ? program->capacity * 2 : 16;
+        Instruction* code = (Instruction*)realloc(program->code, capacity * sizeof(Instruction));
+        if (code == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            exit(1);
+        }
+        program->code = code;
+        program->capacity = capacity;
+    }
+    program->code[program->length].op = op;
+    return (uint32_t)program->length++;
+}
+
+/**
+ * Lower a chain of query nodes (following next, and pipes in order).
+ * select() conditions are only referenced here; their left-hand sides are
+ * compiled after the main program, as bodies of their own.
+ */
+static void compile_chain(QueryProgram* program, QueryNode* node) {
+    uint32_t at;
+
+    for (; node != NULL; node = node->next) {
+        switch (node->type) {
+            case QUERY_IDENTITY:
+                break;
+
+            case QUERY_FIELD:
+                at = emit(program, OP_FIELD);
+                program->code[at].operand.key = &node->data.field;
+                break;
+
+            case QUERY_INDEX:
+                at = emit(program, OP_INDEX);
+                program->code[at].operand.index.position = node->data.index;
+                program->code[at].operand.index.written = node->data.index;
+                program->code[at].operand.index.sliced = 0;
+                break;
+
+            case QUERY_FOLDED_INDEX:
+                at = emit(program, OP_INDEX);
+                program->code[at].operand.index.position = node->data.folded.position;
+                program->code[at].operand.index.written = node->data.folded.written;
+                program->code[at].operand.index.sliced = 1;
+                break;
+
+            case QUERY_SLICE:
+                at = emit(program, OP_SLICE);
+                program->code[at].operand.slice.start = node->data.slice.start;
+                program->code[at].operand.slice.end = node->data.slice.end;
+                break;
+
+            case QUERY_SELECT:
+                at = emit(program, OP_SELECT);
+                program->code[at].operand.select.condition = node->data.condition;
+                program->code[at].operand.select.left = 0;
+                break;
+
+            case QUERY_ARRAY_ITER:
+                if (node->next == NULL) {
+                    emit(program, OP_ITERATE);
+                    break;
                 }
-                
-                return result_array;
-            }
-            
-            return json_data;
+                /* The rest of the chain is the body, run once per element */
+                at = emit(program, OP_MAP);
+                compile_chain(program, node->next);
+                emit(program, OP_RETURN);
+                program->code[at].operand.target = (uint32_t)program->length;
+                return;
+
+            case QUERY_PIPE:
+                compile_chain(program, node->data.pipe.left);
+                compile_chain(program, node->data.pipe.right);
+                break;
         }
-        
-        case QUERY_SELECT: {
-            /* Filter array elements with select() */
-            if (json_data->type != JSON_ARRAY) {
-                fprintf(stderr, "Error: select() can only be applied to arrays\n");
-                return NULL;
+    }
+}
+
+/**
+ * Compile a query AST to bytecode.
+ *
+ * @param query The query AST (must outlive the program)
+ * @return The program
+ */
+QueryProgram* compile_query(QueryNode* query) {
+    QueryProgram* program = (QueryProgram*)calloc(1, sizeof(QueryProgram));
+    size_t pc;
+
+    if (program == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+
+    compile_chain(program, query);
+    emit(program, OP_RETURN);
+
+    /* Condition bodies go after the main program (and after each other) */
+    for (pc = 0; pc < program->length; pc++) {
+        if (program->code[pc].op == OP_SELECT) {
+            uint32_t left = (uint32_t)program->length;
+            compile_chain(program, program->code[pc].operand.select.condition->left);
+            emit(program, OP_RETURN);
+            program->code[pc].operand.select.left = left;
+        }
+    }
+
+    return program;
+}
+
+/**
+ * Free a compiled query.
+ *
+ * @param program The program to free
+ */
+void free_query_program(QueryProgram* program) {
+    if (program == NULL) return;
+    free(program->code);
+    free(program);
+}
+
+/* ---- Optimizer ---- */
+
+/**
+ * A pipeline being rewritten: its operations in order, unlinked. A .[]
+ * followed by more operations keeps them as its body (`next`), which is
+ * optimized on its own; every other operation has no next.
+ */
+typedef struct QueryPlan {
+    QueryNode** ops;
+    size_t count;
+    size_t capacity;
+} QueryPlan;
+
+static void plan_append(QueryPlan* plan, QueryNode* node) {
+    if (plan->count == plan->capacity) {
+        size_t capacity = plan->capacity ? plan->capacity * 2 : 8;
+        QueryNode** ops = (QueryNode**)realloc(plan->ops, capacity * sizeof(QueryNode*));
+        if (ops == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            exit(1);
+        }
+        plan->ops = ops;
+        plan->capacity = capacity;
+    }
+    plan->ops[plan->count++] = node;
+}
+
+/**
+ * Drop an operation from a plan and free it.
+ */
+static void plan_remove(QueryPlan* plan, size_t at) {
+    free_query(plan->ops[at]);
+    memmove(&plan->ops[at], &plan->ops[at + 1], (plan->count - at - 1) * sizeof(QueryNode*));
+    plan->count--;
+}
+
+/**
+ * Add a chain of query nodes to a plan, taking pipes apart and dropping
+ * identities.
+ */
+static void plan_add_chain(QueryPlan* plan, QueryNode* node) {
+    while (node != NULL) {
+        QueryNode* next = node->next;
+        node->next = NULL;
+
+        if (node->type == QUERY_PIPE) {
+            plan_add_chain(plan, node->data.pipe.left);
+            plan_add_chain(plan, node->data.pipe.right);
+            node->data.pipe.left = NULL;
+            node->data.pipe.right = NULL;
+            free_query(node);
+        } else if (node->type == QUERY_IDENTITY) {
+            free_query(node);
+        } else if (node->type == QUERY_ARRAY_ITER && next != NULL) {
+            /* The rest of the chain runs once per element */
+            node->next = optimize_query(next);
+            plan_append(plan, node);
+            return;
+        } else {
+            if (node->type == QUERY_SELECT && node->data.condition->left != NULL) {
+                node->data.condition->left = optimize_query(node->data.condition->left);
             }
-            
-            JsonValue* result_array = create_json_array();
-            JsonArrayElement* elem = json_data->value.array;
-            
-            while (elem != NULL) {
-                if (evaluate_condition(query->data.condition, elem->value)) {
-                    json_array_add(result_array, clone_json_value_internal(elem->value));
+            plan_append(plan, node);
+        }
+        node = next;
+    }
+}
+
+/**
+ * Check whether an operation starts by requiring an array and walking
+ * its elements, so that a .[] passing the array through before it adds
+ * nothing.
+ */
+static int consumes_array(const QueryNode* node) {
+    return node->type == QUERY_SELECT || node->type == QUERY_SLICE ||
+           node->type == QUERY_INDEX || node->type == QUERY_FOLDED_INDEX ||
+           node->type == QUERY_ARRAY_ITER;
+}
+
+/**
+ * Bounds of a slice as the engine applies them: start clamped to 0, end
+ * -1 for "to the end" and clamped to 0 otherwise.
+ */
+static void slice_bounds(const QueryNode* slice, long long* start, long long* end) {
+    *start = slice->data.slice.start < 0 ? 0 : slice->data.slice.start;
+    *end = slice->data.slice.end == -1 ? -1 : (slice->data.slice.end < 0 ? 0 : slice->data.slice.end);
+}
+
+/**
+ * Fold `[a:b] | [c:d]` into one slice of the first.
+ *
+ * @return 1 if `first` now covers both, 0 if the bounds do not fit an int
+ */
+static int fuse_slices(QueryNode* first, const QueryNode* second) {
+    long long start1, end1, start2, end2, start, end;
+
+    slice_bounds(first, &start1, &end1);
+    slice_bounds(second, &start2, &end2);
+
+    start = start1 + start2;
+    if (end2 == -1) {
+        end = end1;
+    } else {
+        end = start1 + end2;
+        if (end1 != -1 && end1 < end) end = end1;
+    }
+    if (end != -1 && end < start) end = start;
+    if (start > INT_MAX || end > INT_MAX) return 0;
+
+    first->data.slice.start = (int)start;
+    first->data.slice.end = (int)end;
+    return 1;
+}
+
+/**
+ * Fold `[a:b] | [i]` into the index `[a + i]`, when element i of the slice
+ * exists whenever the array is long enough. The node keeps i, so errors
+ * read as they would for the slice and index run one after the other.
+ *
+ * @return 1 if `slice` became that index, 0 if it was left alone
+ */
+static int fuse_slice_index(QueryNode* slice, const QueryNode* index) {
+    long long start, end, position;
+
+    if (index->data.index < 0) return 0;
+    slice_bounds(slice, &start, &end);
+    position = start + index->data.index;
+    if ((end != -1 && position >= end) || position > INT_MAX) return 0;
+
+    slice->type = QUERY_FOLDED_INDEX;
+    slice->data.folded.position = (int)position;
+    slice->data.folded.written = index->data.index;
+    return 1;
+}
+
+/**
+ * Apply the rewrite rules to neighbouring operations until none fires.
+ * Each rule only removes work, so no costs need comparing.
+ */
+static void plan_simplify(QueryPlan* plan) {
+    size_t i = 0;
+
+    while (i + 1 < plan->count) {
+        QueryNode* node = plan->ops[i];
+        QueryNode* following = plan->ops[i + 1];
+        /* A full slice before an index is folded below instead, so a
+         * non-array still reports the slice */
+        int full_slice = node->type == QUERY_SLICE && node->data.slice.start <= 0 &&
+                         node->data.slice.end == -1 && following->type != QUERY_INDEX;
+
+        if (((node->type == QUERY_ARRAY_ITER && node->next == NULL) || full_slice) &&
+            consumes_array(following)) {
+            /* .[] | select(...) is a single filtered pass over the array */
+            plan_remove(plan, i);
+        } else if (node->type == QUERY_SLICE && following->type == QUERY_SLICE &&
+                   fuse_slices(node, following)) {
+            plan_remove(plan, i + 1);
+        } else if (node->type == QUERY_SLICE && following->type == QUERY_INDEX &&
+                   fuse_slice_index(node, following)) {
+            plan_remove(plan, i + 1);
+        } else {
+            i++;
+            continue;
+        }
+
+        /* The merged operation may combine with the one before it */
+        if (i > 0) i--;
+    }
+}
+
+/**
+ * Link a plan's operations from `from` on back into an AST. Chains are as
+ * long as possible; only a .[] ends one, since whatever it is linked to
+ * becomes its per-element body.
+ */
+static QueryNode* plan_build(QueryPlan* plan, size_t from) {
+    size_t end = from;
+
+    while (end + 1 < plan->count && plan->ops[end]->type != QUERY_ARRAY_ITER) {
+        plan->ops[end]->next = plan->ops[end + 1];
+        end++;
+    }
+    if (end + 1 == plan->count) {
+        return plan->ops[from];
+    }
+    return create_pipe_node(plan->ops[from], plan_build(plan, end + 1));
+}
+
+/**
+ * Rewrite a query into an equivalent one that does less work:
+ * - pipes are flattened into chains wherever that keeps their meaning,
+ *   and identities dropped;
+ * - a .[] (or [0:]) passing an array to select(), a slice, an index or
+ *   another .[] is removed, so `.[] | select(...)` is one filtered pass;
+ * - consecutive slices, and a slice followed by an index, become a single
+ *   slice or index.
+ * Flat chains also let json_projection_create() see past select(), so
+ * the parser builds only the fields the filter and later stages read.
+ *
+ * @param query The parsed query (taken over; dropped nodes are freed)
+ * @return The optimized query
+ */
+QueryNode* optimize_query(QueryNode* query) {
+    QueryPlan plan = { NULL, 0, 0 };
+    QueryNode* result;
+
+    plan_add_chain(&plan, query);
+    plan_simplify(&plan);
+
+    if (plan.count == 0) {
+        result = (QueryNode*)malloc(sizeof(QueryNode));
+        if (result == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            exit(1);
+        }
+        result->type = QUERY_IDENTITY;
+        result->next = NULL;
+    } else {
+        result = plan_build(&plan, 0);
+    }
+
+    free(plan.ops);
+    return result;
+}
+
+/* ---- Explain ---- */
+
+static const char* const opcode_names[] = {
+    [OP_FIELD] = "FIELD",
+    [OP_INDEX] = "INDEX",
+    [OP_SLICE] = "SLICE",
+    [OP_SELECT] = "SELECT",
+    [OP_ITERATE] = "ITERATE",
+    [OP_MAP] = "MAP",
+    [OP_RETURN] = "RETURN",
+};
+
+static const char* const comparison_names[] = {
+    [CMP_GT] = ">",
+    [CMP_LT] = "<",
+    [CMP_EQ] = "==",
+    [CMP_GTE] = ">=",
+    [CMP_LTE] = "<=",
+    [CMP_NEQ] = "!=",
+};
+
+/**
+ * Print the comparison of a select() condition, e.g. `> 998`.
+ */
+static void print_comparison(const ConditionExpr* condition, FILE* out) {
+    const char* op = (unsigned)condition->op <= CMP_NEQ ? comparison_names[condition->op] : "?";
+    char number[32];
+    int precision;
+
+    /* The shortest form that reads back as the same double */
+    for (precision = 15; precision < 17; precision++) {
+        snprintf(number, sizeof(number), "%.*g", precision, condition->value);
+        if (strtod(number, NULL) == condition->value) break;
+    }
+    if (precision == 17) {
+        snprintf(number, sizeof(number), "%.17g", condition->value);
+    }
+    fprintf(out, "%s %s", op, number);
+}
+
+/**
+ * Print a query AST in query syntax, chained operations separated by
+ * spaces.
+ */
+static void print_query(const QueryNode* node, FILE* out) {
+    const QueryNode* first = node;
+
+    for (; node != NULL; node = node->next) {
+        if (node != first) fputc(' ', out);
+        switch (node->type) {
+            case QUERY_IDENTITY:
+                fputc('.', out);
+                break;
+            case QUERY_FIELD:
+                fprintf(out, ".%s", node->data.field.name);
+                break;
+            case QUERY_INDEX:
+                fprintf(out, "[%d]", node->data.index);
+                break;
+            case QUERY_FOLDED_INDEX:
+                fprintf(out, "[%d]", node->data.folded.position);
+                break;
+            case QUERY_SLICE:
+                if (node->data.slice.end == -1) {
+                    fprintf(out, "[%d:]", node->data.slice.start);
+                } else {
+                    fprintf(out, "[%d:%d]", node->data.slice.start, node->data.slice.end);
                 }
-                elem = elem->next;
-            }
-            
-            return execute_query_internal(query->next, result_array);
+                break;
+            case QUERY_ARRAY_ITER:
+                fputs(".[]", out);
+                break;
+            case QUERY_SELECT:
+                fputs("select(", out);
+                print_query(node->data.condition->left, out);
+                fputc(' ', out);
+                print_comparison(node->data.condition, out);
+                fputc(')', out);
+                break;
+            case QUERY_PIPE:
+                print_query(node->data.pipe.left, out);
+                fputs(" | ", out);
+                print_query(node->data.pipe.right, out);
+                break;
         }
-        
-        case QUERY_PIPE: {
-            /* Pipe: execute left side, then feed result to right side */
-            JsonValue* left_result = execute_query_internal(query->data.pipe.left, json_data);
-            if (left_result == NULL) {
-                return NULL;
-            }
-            
-            JsonValue* final_result = execute_query_internal(query->data.pipe.right, left_result);
-            
-            /* Continue with any remaining operations */
-            if (query->next != NULL) {
-                return execute_query_internal(query->next, final_result);
-            }
-            
-            return final_result;
+    }
+}
+
+/**
+ * Print a query as it will run: the query after optimize_query(), then
+ * the bytecode it compiles to, one instruction per line.
+ *
+ * @param query The query AST
+ * @param out Where to print
+ */
+void explain_query(QueryNode* query, FILE* out) {
+    QueryProgram* program = compile_query(query);
+    size_t pc;
+
+    fputs("Plan: ", out);
+    print_query(query, out);
+    fputc('\n', out);
+
+    for (pc = 0; pc < program->length; pc++) {
+        const Instruction* instruction = &program->code[pc];
+
+        fprintf(out, "  %4lu  %s", (unsigned long)pc, opcode_names[instruction->op]);
+        if (instruction->op != OP_RETURN && instruction->op != OP_ITERATE) {
+            fprintf(out, "%*s", 8 - (int)strlen(opcode_names[instruction->op]), "");
         }
-        
-        default:
-            fprintf(stderr, "Error: Unknown query operation type\n");
-            return NULL;
+        switch (instruction->op) {
+            case OP_FIELD:
+                fprintf(out, ".%s", instruction->operand.key->name);
+                break;
+            case OP_INDEX:
+                fprintf(out, "[%d]", instruction->operand.index.position);
+                break;
+            case OP_SLICE:
+                if (instruction->operand.slice.end == -1) {
+                    fprintf(out, "[%d:]", instruction->operand.slice.start);
+                } else {
+                    fprintf(out, "[%d:%d]", instruction->operand.slice.start,
+                            instruction->operand.slice.end);
+                }
+                break;
+            case OP_SELECT:
+                print_query(instruction->operand.select.condition->left, out);
+                fputc(' ', out);
+                print_comparison(instruction->operand.select.condition, out);
+                fprintf(out, " (left side at %lu)",
+                        (unsigned long)instruction->operand.select.left);
+                break;
+            case OP_MAP:
+                fprintf(out, "body at %lu, then %lu", (unsigned long)(pc + 1),
+                        (unsigned long)instruction->operand.target);
+                break;
+            default:
+                break;
+        }
+        fputc('\n', out);
+    }
+
+    free_query_program(program);
+}
+
+/* ---- Execution ---- */
+
+/**
+ * Execute a compiled query and return the complete result.
+ *
+ * @param program The compiled query
+ * @param json_data The JSON data to query
+ * @return A new reference to the result, or NULL on error
+ */
+JsonValue* execute_program(const QueryProgram* program, JsonValue* json_data) {
+    if (json_data == NULL) {
+        fprintf(stderr, "Error: Cannot execute query on NULL JSON data\n");
+        return NULL;
     }
+
+    return run_subprogram(program, 0, json_data);
 }
 
 /**
  * Execute a query on JSON data and return the result.
  * UPGRADED: Now supports pipes, filtering, and slicing.
- * 
+ *
  * @param query The query AST
  * @param json_data The JSON data to query
  * @return The result of the query
  */
 JsonValue* execute_query(QueryNode* query, JsonValue* json_data) {
+    QueryProgram* program = compile_query(query);
+    JsonValue* result = execute_program(program, json_data);
+    free_query_program(program);
+    return result;
+}
+
+/**
+ * Start executing a compiled query, leaving its array stages to run on
+ * demand.
+ *
+ * @param program The compiled query (must outlive the stream)
+ * @param json_data The JSON data to query (must outlive the stream)
+ * @return The result stream, or NULL on error
+ */
+JsonStream* execute_program_stream(const QueryProgram* program, JsonValue* json_data) {
+    JsonStream* stream;
+    StageResult result;
+
     if (json_data == NULL) {
         fprintf(stderr, "Error: Cannot execute query on NULL JSON data\n");
         return NULL;
     }
-    
-    return execute_query_internal(query, json_data);
+
+    result = run_program(program, 0, stage_value(json_value_retain(json_data)));
+    if (result.value == NULL && result.elements == NULL) {
+        return NULL;
+    }
+
+    stream = (JsonStream*)malloc(sizeof(JsonStream));
+    if (stream == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    stream->result = result;
+    stream->program = NULL;
+    return stream;
+}
+
+/**
+ * Start executing a query, leaving its array stages to run on demand.
+ *
+ * @param query The query AST
+ * @param json_data The JSON data to query (must outlive the stream)
+ * @return The result stream, or NULL on error
+ */
+JsonStream* execute_query_stream(QueryNode* query, JsonValue* json_data) {
+    QueryProgram* program = compile_query(query);
+    JsonStream* stream = execute_program_stream(program, json_data);
+
+    if (stream == NULL) {
+        free_query_program(program);
+        return NULL;
+    }
+    stream->program = program;
+    return stream;
+}
+
+/**
+ * Print a query result in the format of print_json_result(), computing
+ * each element of a lazy array just before it is printed.
+ *
+ * @param stream The result stream (its elements are consumed)
+ * @param indent Current indentation level
+ */
+void print_json_stream(JsonStream* stream, int indent) {
+    Generator* elements = stream->result.elements;
+    JsonValue* element;
+    size_t k = 0;
+
+    if (elements == NULL) {
+        print_json_result(stream->result.value, indent);
+        return;
+    }
+
+    json_output_char('[');
+    while (elements->next(elements, &element)) {
+        if (k++ > 0) json_output_char(',');
+        print_line_break(indent + 2);
+        print_json_value(element, indent + 2);
+        free_json_value(element);
+    }
+    /* Pretty output keeps an empty array's line break, as before */
+    if (k == 0 && !print_compact) json_output_char('\n');
+    print_line_break(indent);
+    json_output_char(']');
+}
+
+/**
+ * Free a result stream, including the elements it has not produced.
+ *
+ * @param stream The stream to free
+ */
+void free_json_stream(JsonStream* stream) {
+    if (stream == NULL) return;
+    stage_release(stream->result);
+    free_query_program(stream->program);
+    free(stream);
 }
 
 /**
@@ -562,7 +2280,7 @@ void free_query(QueryNode* query) {
     
     switch (query->type) {
         case QUERY_FIELD:
-            free(query->data.field);
+            free(query->data.field.name);
             break;
             
         case QUERY_PIPE:
@@ -585,6 +2303,29 @@ void free_query(QueryNode* query) {
     free_query(next);
 }
 
+/**
+ * Create a new query node for field access.
+ * The key's length and hash are computed here, once, and the name is
+ * interned so that lookups match document keys by pointer.
+ * 
+ * @param name The field name (owned by the node from now on)
+ */
+QueryNode* create_field_node(char* name) {
+    QueryNode* node = (QueryNode*)malloc(sizeof(QueryNode));
+    node->type = QUERY_FIELD;
+    node->data.field.name = name;
+    node->data.field.length = strlen(name);
+    node->data.field.hash = json_hash_key(name, node->data.field.length);
+    node->data.field.atom = json_atom_intern(name, node->data.field.length,
+                                             node->data.field.hash);
+    if (node->data.field.atom == NULL) {
+        node->data.field.atom = name;
+    }
+    atomic_init(&node->data.field.shape_cache, 0);
+    node->next = NULL;
+    return node;
+}
+
 /**
  * Create a new query node for pipe operation.
  */
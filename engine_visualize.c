@@ -12,7 +12,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <float.h>
 #include "json_value.h"
+#include "json_number.h"
+#include "json_atom.h"
+#include "json_shape.h"
+#include "json_output.h"
 
 /* External flag for visualization mode */
 extern int g_visualize_mode;
@@ -54,12 +61,26 @@ static const char* get_type_name(JsonType type) {
     }
 }
 
+/**
+ * Allocate a JSON value of the given type.
+ * Values come from the current arena while one is set (see json_arena.h),
+ * otherwise from the heap.
+ * 
+ * @param type The type of the new value
+ */
+static JsonValue* alloc_json_value(JsonType type) {
+    JsonValue* val = (JsonValue*)json_alloc(sizeof(JsonValue));
+    val->type = type;
+    val->flags = json_arena_current() ? JSON_FLAG_ARENA : 0;
+    atomic_init(&val->refcount, 1);
+    return val;
+}
+
 /**
  * Create a new JSON null value.
  */
 JsonValue* create_json_null() {
-    JsonValue* val = (JsonValue*)malloc(sizeof(JsonValue));
-    val->type = JSON_NULL;
+    JsonValue* val = alloc_json_value(JSON_NULL);
     return val;
 }
 
@@ -69,8 +90,7 @@ JsonValue* create_json_null() {
  * @param is_true 1 for true, 0 for false
  */
 JsonValue* create_json_bool(int is_true) {
-    JsonValue* val = (JsonValue*)malloc(sizeof(JsonValue));
-    val->type = is_true ? JSON_TRUE : JSON_FALSE;
+    JsonValue* val = alloc_json_value(is_true ? JSON_TRUE : JSON_FALSE);
     return val;
 }
 
@@ -80,9 +100,36 @@ JsonValue* create_json_bool(int is_true) {
  * @param num The numeric value
  */
 JsonValue* create_json_number(double num) {
-    JsonValue* val = (JsonValue*)malloc(sizeof(JsonValue));
-    val->type = JSON_NUMBER;
-    val->value.number = num;
+    JsonValue* val = alloc_json_value(JSON_NUMBER);
+    val->value.number.as.real = num;
+    val->value.number.raw = NULL;
+    val->value.number.raw_length = 0;
+    return val;
+}
+
+/**
+ * Create a new JSON number value from its literal.
+ * 
+ * @param text The literal (must match the JSON number grammar)
+ * @param length Length of the literal
+ */
+JsonValue* create_json_number_text(const char* text, size_t length) {
+    JsonValue* val = alloc_json_value(JSON_NUMBER);
+    int64_t integer;
+    
+    if (json_number_convert(text, length, &val->value.number.as.real, &integer)) {
+        val->value.number.as.integer = integer;
+        val->flags |= JSON_FLAG_INTEGER;
+    }
+    
+    /* Only arena documents share the lifetime of their input */
+    if (val->flags & JSON_FLAG_ARENA) {
+        val->value.number.raw = text;
+        val->value.number.raw_length = length;
+    } else {
+        val->value.number.raw = NULL;
+        val->value.number.raw_length = 0;
+    }
     return val;
 }
 
@@ -92,9 +139,41 @@ JsonValue* create_json_number(double num) {
  * @param str The string value (will be copied)
  */
 JsonValue* create_json_string(const char* str) {
-    JsonValue* val = (JsonValue*)malloc(sizeof(JsonValue));
-    val->type = JSON_STRING;
-    val->value.string = strdup(str);
+    return create_json_string_len(str, strlen(str));
+}
+
+/**
+ * Create a new JSON string value from a length-delimited buffer.
+ * 
+ * @param str The string bytes (will be copied)
+ * @param len Number of bytes
+ */
+JsonValue* create_json_string_len(const char* str, size_t len) {
+    JsonValue* val = alloc_json_value(JSON_STRING);
+    val->value.string.data = json_strndup(str, len);
+    val->value.string.length = len;
+    return val;
+}
+
+/**
+ * Create a JSON string value for a span of parser input.
+ * Arena documents refer to the input in place; otherwise it is copied.
+ * 
+ * @param str The string bytes
+ * @param len Number of bytes
+ * @param escaped Nonzero if the bytes still contain escape sequences
+ */
+JsonValue* create_json_string_span(const char* str, size_t len, int escaped) {
+    JsonValue* val = alloc_json_value(JSON_STRING);
+    if (val->flags & JSON_FLAG_ARENA) {
+        val->value.string.data = str;
+    } else {
+        val->value.string.data = json_strndup(str, len);
+    }
+    val->value.string.length = len;
+    if (escaped) {
+        val->flags |= JSON_FLAG_ESCAPED;
+    }
     return val;
 }
 
@@ -102,9 +181,11 @@ JsonValue* create_json_string(const char* str) {
  * Create a new empty JSON array.
  */
 JsonValue* create_json_array() {
-    JsonValue* val = (JsonValue*)malloc(sizeof(JsonValue));
-    val->type = JSON_ARRAY;
-    val->value.array = NULL;
+    JsonValue* val = alloc_json_value(JSON_ARRAY);
+    val->value.array.items = NULL;
+    val->value.array.length = 0;
+    val->value.array.capacity = 0;
+    val->value.array.columns = NULL;
     return val;
 }
 
@@ -112,15 +193,45 @@ JsonValue* create_json_array() {
  * Create a new empty JSON object.
  */
 JsonValue* create_json_object() {
-    JsonValue* val = (JsonValue*)malloc(sizeof(JsonValue));
-    val->type = JSON_OBJECT;
-    val->value.object = NULL;
+    JsonValue* val = alloc_json_value(JSON_OBJECT);
+    val->value.object.members = NULL;
+    val->value.object.index = NULL;
+    val->value.object.length = 0;
+    val->value.object.capacity = 0;
+    val->value.object.shape = JSON_SHAPE_EMPTY;
     return val;
 }
 
+/**
+ * Make sure a JSON array has room for at least `capacity` elements.
+ * 
+ * @param array The JSON array to grow
+ * @param capacity The minimum number of element slots required
+ */
+void json_array_reserve(JsonValue* array, size_t capacity) {
+    if (array->type != JSON_ARRAY) return;
+    if (capacity <= array->value.array.capacity) return;
+    
+    JsonValue** items;
+    if (array->flags & JSON_FLAG_ARENA) {
+        items = (JsonValue**)json_arena_realloc(json_arena_current(), array->value.array.items,
+                                                array->value.array.capacity * sizeof(JsonValue*),
+                                                capacity * sizeof(JsonValue*));
+    } else {
+        items = (JsonValue**)realloc(array->value.array.items, capacity * sizeof(JsonValue*));
+    }
+    if (items == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    array->value.array.items = items;
+    array->value.array.capacity = capacity;
+}
+
 /**
  * Add an element to a JSON array.
- * Elements are appended to the end of the array.
+ * Elements are appended to the end of the array; the buffer doubles
+ * when full so appends are amortized O(1).
  * 
  * @param array The JSON array to add to
  * @param element The value to add
@@ -128,44 +239,202 @@ JsonValue* create_json_object() {
 void json_array_add(JsonValue* array, JsonValue* element) {
     if (array->type != JSON_ARRAY) return;
     
-    JsonArrayElement* new_elem = (JsonArrayElement*)malloc(sizeof(JsonArrayElement));
-    new_elem->value = element;
-    new_elem->next = NULL;
+    JsonArray* arr = &array->value.array;
+    if (arr->length == arr->capacity) {
+        json_array_reserve(array, arr->capacity ? arr->capacity * 2 : 4);
+    }
+    arr->items[arr->length++] = element;
+}
+
+/**
+ * Rebuild the hash index of a JSON object for its current capacity.
+ * 
+ * @param object The JSON object to index
+ */
+static void object_build_index(JsonValue* object) {
+    JsonObject* obj = &object->value.object;
+    size_t slots = obj->capacity * 2;
+    size_t mask = slots - 1;
+    size_t k;
+    uint32_t* index;
+    
+    if (object->flags & JSON_FLAG_ARENA) {
+        /* The old index is released with the arena */
+        index = (uint32_t*)json_arena_alloc(json_arena_current(), slots * sizeof(uint32_t));
+    } else {
+        free(obj->index);
+        index = (uint32_t*)malloc(slots * sizeof(uint32_t));
+    }
+    if (index == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    memset(index, 0, slots * sizeof(uint32_t));
+    
+    for (k = 0; k < obj->length; k++) {
+        size_t slot = obj->members[k].hash & mask;
+        while (index[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        index[slot] = (uint32_t)(k + 1);
+    }
+    obj->index = index;
+}
+
+/**
+ * Make sure a JSON object has room for at least `capacity` members.
+ * The capacity is rounded up to a power of two, and the hash index is
+ * rebuilt once it exceeds JSON_OBJECT_INDEX_THRESHOLD.
+ * 
+ * @param object The JSON object to grow
+ * @param capacity The minimum number of member slots required
+ */
+void json_object_reserve(JsonValue* object, size_t capacity) {
+    if (object->type != JSON_OBJECT) return;
+    
+    JsonObject* obj = &object->value.object;
+    if (capacity <= obj->capacity) return;
     
-    if (array->value.array == NULL) {
-        array->value.array = new_elem;
+    size_t new_capacity = obj->capacity ? obj->capacity : 4;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+    
+    JsonObjectMember* members;
+    if (object->flags & JSON_FLAG_ARENA) {
+        members = (JsonObjectMember*)json_arena_realloc(json_arena_current(), obj->members,
+                                                        obj->capacity * sizeof(JsonObjectMember),
+                                                        new_capacity * sizeof(JsonObjectMember));
     } else {
-        JsonArrayElement* curr = array->value.array;
-        while (curr->next != NULL) {
-            curr = curr->next;
+        members = (JsonObjectMember*)realloc(obj->members, new_capacity * sizeof(JsonObjectMember));
+    }
+    if (members == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    obj->members = members;
+    obj->capacity = (uint32_t)new_capacity;
+    
+    if (new_capacity > JSON_OBJECT_INDEX_THRESHOLD) {
+        object_build_index(object);
+    }
+}
+
+/**
+ * Find a member of a JSON object: a linear scan for small objects, a
+ * probe of the hash index for large ones. Interned keys match by pointer.
+ * 
+ * @param obj The object's members
+ * @param key The key to find
+ * @param key_length Length of the key
+ * @param hash json_hash_key() of the key
+ * @return The member, or NULL if not found
+ */
+static JsonObjectMember* object_find(const JsonObject* obj, const char* key, size_t key_length,
+                                     uint32_t hash) {
+    JsonObjectMember* member;
+    
+    if (obj->index == NULL) {
+        size_t k;
+        for (k = 0; k < obj->length; k++) {
+            member = &obj->members[k];
+            if (member->hash == hash && (member->key == key ||
+                (member->key_length == key_length && memcmp(member->key, key, key_length) == 0))) {
+                return member;
+            }
         }
-        curr->next = new_elem;
+        return NULL;
     }
+    
+    size_t mask = obj->capacity * 2 - 1;
+    size_t slot = hash & mask;
+    uint32_t position;
+    while ((position = obj->index[slot]) != 0) {
+        member = &obj->members[position - 1];
+        if (member->hash == hash && (member->key == key ||
+            (member->key_length == key_length && memcmp(member->key, key, key_length) == 0))) {
+            return member;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
 }
 
 /**
- * Add a member (key-value pair) to a JSON object using hash table.
- * UPGRADED: Uses uthash for O(1) insertion.
+ * Add a member (key-value pair) to a JSON object.
  * 
  * @param object The JSON object to add to
  * @param key The key (field name)
  * @param value The value
  */
 void json_object_add(JsonValue* object, const char* key, JsonValue* value) {
+    json_object_add_member(object, key, strlen(key), value);
+}
+
+/**
+ * Add a member whose key is given by pointer and length. The key is
+ * interned (or copied if the atom table cannot take it), so the caller
+ * keeps ownership of its buffer. A duplicate key keeps its position but
+ * takes the new value, as in jq.
+ * 
+ * @param object The JSON object to add to
+ * @param key The key
+ * @param key_length Length of the key
+ * @param value The value
+ */
+void json_object_add_member(JsonValue* object, const char* key, size_t key_length,
+                            JsonValue* value) {
     if (object->type != JSON_OBJECT) return;
     
-    JsonObjectMember* new_member = (JsonObjectMember*)malloc(sizeof(JsonObjectMember));
-    new_member->key = strdup(key);
-    new_member->value = value;
+    JsonObject* obj = &object->value.object;
+    uint32_t hash = json_hash_key(key, key_length);
+    JsonObjectMember* member = object_find(obj, key, key_length, hash);
+    
+    if (member != NULL) {
+        if (!(object->flags & JSON_FLAG_ARENA)) {
+            free_json_value(member->value);
+        }
+        member->value = value;
+        return;
+    }
     
-    /* Add to hash table using uthash */
-    HASH_ADD_KEYPTR(hh, object->value.object, new_member->key, 
-                   strlen(new_member->key), new_member);
+    /* Only records made of interned keys are tracked by shape */
+    const char* stored_key = json_atom_intern(key, key_length, hash);
+    int key_copied = stored_key == NULL;
+    if (stored_key != NULL && obj->shape != JSON_SHAPE_NONE &&
+        obj->length < JSON_SHAPE_MAX_MEMBERS) {
+        obj->shape = json_shape_transition(obj->shape, stored_key);
+    } else {
+        obj->shape = JSON_SHAPE_NONE;
+    }
+    if (key_copied) {
+        stored_key = json_strndup(key, key_length);
+    }
+    
+    if (obj->length == obj->capacity) {
+        json_object_reserve(object, obj->length + 1);
+    }
+    
+    member = &obj->members[obj->length];
+    member->key = stored_key;
+    member->key_length = key_length;
+    member->hash = hash;
+    member->key_copied = (uint8_t)key_copied;
+    member->value = value;
+    
+    if (obj->index != NULL) {
+        size_t mask = obj->capacity * 2 - 1;
+        size_t slot = hash & mask;
+        while (obj->index[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        obj->index[slot] = (uint32_t)(obj->length + 1);
+    }
+    obj->length++;
 }
 
 /**
  * Find a member in a JSON object by key.
- * UPGRADED: Uses uthash for O(1) lookup.
  * 
  * @param object The JSON object to search
  * @param key The key to find
@@ -174,90 +443,220 @@ void json_object_add(JsonValue* object, const char* key, JsonValue* value) {
 JsonValue* json_object_get(JsonValue* object, const char* key) {
     if (object->type != JSON_OBJECT) return NULL;
     
-    JsonObjectMember* member;
-    HASH_FIND_STR(object->value.object, key, member);
+    size_t key_length = strlen(key);
+    uint32_t hash = json_hash_key(key, key_length);
+    const char* atom = json_atom_find(key, key_length, hash);
+    JsonObjectMember* member = object_find(&object->value.object, atom ? atom : key,
+                                           key_length, hash);
     
     return member ? member->value : NULL;
 }
 
 /**
- * Print a JSON value to stdout with proper formatting.
- * UPGRADED: Works with hash table structure.
+ * Find a member in a JSON object by a key prepared at query compile time.
+ * If the object has the shape the key was last found in, the member is
+ * read straight from the cached position; otherwise the object is
+ * searched without hashing the key again and the cache is updated.
  * 
- * @param value The JSON value to print
- * @param indent Current indentation level (for pretty printing)
+ * @param object The JSON object to search
+ * @param key The prepared key (its inline cache may be updated)
+ * @return The value associated with the key, or NULL if not found
  */
-void print_json_value(JsonValue* value, int indent) {
+JsonValue* json_object_get_key(JsonValue* object, JsonKey* key) {
+    if (object->type != JSON_OBJECT) return NULL;
+    
+    JsonObject* obj = &object->value.object;
+    uint64_t cached = atomic_load_explicit(&key->shape_cache, memory_order_relaxed);
+    
+    if (obj->shape != JSON_SHAPE_NONE && (uint32_t)(cached >> 32) == obj->shape) {
+        if (json_shape_stats_enabled) json_shape_count_lookup(1);
+        return obj->members[(uint32_t)cached].value;
+    }
+    if (json_shape_stats_enabled) json_shape_count_lookup(0);
+    
+    JsonObjectMember* member = object_find(obj, key->atom, key->length, key->hash);
+    if (member == NULL) return NULL;
+    
+    if (obj->shape != JSON_SHAPE_NONE) {
+        atomic_store_explicit(&key->shape_cache,
+                              ((uint64_t)obj->shape << 32) | (uint64_t)(member - obj->members),
+                              memory_order_relaxed);
+    }
+    return member->value;
+}
+
+/* Re-emit parsed numbers verbatim (set once at startup, read-only after) */
+static int print_raw_numbers = 0;
+
+/**
+ * Make print_json_value() print numbers as written in the input.
+ * 
+ * @param enabled Nonzero to print the original literals
+ */
+void json_print_raw_numbers(int enabled) {
+    print_raw_numbers = enabled;
+}
+
+/* Print on one line without indentation (set once at startup) */
+static int print_compact = 0;
+
+/**
+ * Make print_json_value() print compact, single-line JSON.
+ * 
+ * @param enabled Nonzero for compact output
+ */
+void json_print_compact(int enabled) {
+    print_compact = enabled;
+}
+
+/**
+ * Print a value that is not an array or object.
+ */
+static void print_scalar(const JsonValue* value) {
+    char buffer[JSON_NUMBER_BUFFER_SIZE];
+
     if (value == NULL) {
-        printf("null");
+        JSON_OUTPUT_LITERAL("null");
         return;
     }
     
-    int i;
     switch (value->type) {
         case JSON_NULL:
-            printf("null");
+            JSON_OUTPUT_LITERAL("null");
             break;
             
         case JSON_TRUE:
-            printf("true");
+            JSON_OUTPUT_LITERAL("true");
             break;
             
         case JSON_FALSE:
-            printf("false");
+            JSON_OUTPUT_LITERAL("false");
             break;
             
         case JSON_NUMBER:
-            // Print integers without decimal point
-            if (value->value.number == (int)value->value.number) {
-                printf("%d", (int)value->value.number);
+            if (print_raw_numbers && value->value.number.raw != NULL) {
+                json_output_write(value->value.number.raw, value->value.number.raw_length);
+            } else if (value->flags & JSON_FLAG_INTEGER) {
+                json_output_write(buffer, json_number_format_int64(value->value.number.as.integer,
+                                                                   buffer));
             } else {
-                printf("%g", value->value.number);
+                json_output_write(buffer, json_number_format_double(value->value.number.as.real,
+                                                                    buffer));
             }
             break;
             
         case JSON_STRING:
-            printf("\"%s\"", value->value.string);
+            /* Escaped spans keep the escape sequences written in the input */
+            json_output_string(value->value.string.data, value->value.string.length,
+                               (value->flags & JSON_FLAG_ESCAPED) != 0);
             break;
-            
-        case JSON_ARRAY:
-            printf("[\n");
-            {
-                JsonArrayElement* elem = value->value.array;
-                int first = 1;
-                while (elem != NULL) {
-                    if (!first) printf(",\n");
-                    for (i = 0; i < indent + 2; i++) printf(" ");
-                    print_json_value(elem->value, indent + 2);
-                    elem = elem->next;
-                    first = 0;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Start a line inside a container: a newline and the indentation of
+ * `indent` spaces, or nothing when printing compact.
+ */
+static void print_line_break(int indent) {
+    if (!print_compact) {
+        json_output_char('\n');
+        json_output_indent(indent);
+    }
+}
+
+/**
+ * A container being printed by print_json_value().
+ */
+typedef struct PrintFrame {
+    const JsonValue* container;         // Array or object
+    size_t next;                        // Index of the next element or member
+} PrintFrame;
+
+#define PRINT_STACK_INLINE 64           // Levels before the stack moves to the heap
+
+/**
+ * Print a JSON value to stdout, pretty-printed with two-space indentation
+ * or compact (see json_print_compact()). Containers are walked with an
+ * explicit stack rather than recursion, so depth only costs a frame of
+ * memory per level.
+ * Output goes through the json_output buffer; call json_output_flush()
+ * before printing anything else with stdio.
+ * 
+ * @param value The JSON value to print
+ * @param indent Current indentation level (for pretty printing)
+ */
+void print_json_value(JsonValue* value, int indent) {
+    PrintFrame inline_stack[PRINT_STACK_INLINE];
+    PrintFrame* stack = inline_stack;
+    size_t capacity = PRINT_STACK_INLINE;
+    size_t depth = 0;
+    const JsonValue* current = value;
+
+    for (;;) {
+        /* Print a scalar, or open a container and descend into it */
+        if (current == NULL || (current->type != JSON_ARRAY && current->type != JSON_OBJECT)) {
+            print_scalar(current);
+        } else {
+            if (depth == capacity) {
+                PrintFrame* grown = (PrintFrame*)malloc(capacity * 2 * sizeof(PrintFrame));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Memory allocation failed\n");
+                    exit(1);
                 }
+                memcpy(grown, stack, depth * sizeof(PrintFrame));
+                if (stack != inline_stack) free(stack);
+                stack = grown;
+                capacity *= 2;
             }
-            printf("\n");
-            for (i = 0; i < indent; i++) printf(" ");
-            printf("]");
-            break;
-            
-        case JSON_OBJECT:
-            printf("{\n");
-            {
-                JsonObjectMember* member;
-                int first = 1;
-                
-                /* Iterate through hash table */
-                for (member = value->value.object; member != NULL; member = member->hh.next) {
-                    if (!first) printf(",\n");
-                    for (i = 0; i < indent + 2; i++) printf(" ");
-                    printf("\"%s\": ", member->key);
-                    print_json_value(member->value, indent + 2);
-                    first = 0;
+            stack[depth].container = current;
+            stack[depth].next = 0;
+            depth++;
+            json_output_char(current->type == JSON_ARRAY ? '[' : '{');
+            /* Pretty output keeps an empty container's line break, as before */
+            if (!print_compact && (current->type == JSON_ARRAY ? current->value.array.length
+                                                               : current->value.object.length) == 0) {
+                json_output_char('\n');
+            }
+        }
+
+        /* Move on to the next element, closing the containers that are done */
+        current = NULL;
+        while (depth > 0) {
+            PrintFrame* frame = &stack[depth - 1];
+            const JsonValue* container = frame->container;
+            int level = indent + 2 * (int)depth;
+
+            if (container->type == JSON_ARRAY && frame->next < container->value.array.length) {
+                if (frame->next > 0) json_output_char(',');
+                print_line_break(level);
+                current = container->value.array.items[frame->next++];
+                break;
+            }
+            if (container->type == JSON_OBJECT && frame->next < container->value.object.length) {
+                const JsonObjectMember* member = &container->value.object.members[frame->next++];
+                if (frame->next > 1) json_output_char(',');
+                print_line_break(level);
+                json_output_string(member->key, member->key_length, 0);
+                if (print_compact) {
+                    json_output_char(':');
+                } else {
+                    JSON_OUTPUT_LITERAL(": ");
                 }
+                current = member->value;
+                break;
             }
-            printf("\n");
-            for (i = 0; i < indent; i++) printf(" ");
-            printf("}");
-            break;
+
+            print_line_break(level - 2);
+            json_output_char(container->type == JSON_ARRAY ? ']' : '}');
+            depth--;
+        }
+        if (depth == 0) break;
     }
+
+    if (stack != inline_stack) free(stack);
 }
 
 /**
@@ -286,30 +685,38 @@ static JsonValue* clone_json_value_internal(JsonValue* value) {
         case JSON_FALSE:
             return create_json_bool(0);
             
-        case JSON_NUMBER:
-            return create_json_number(value->value.number);
+        case JSON_NUMBER: {
+            JsonValue* new_number = create_json_number(0);
+            new_number->value.number.as = value->value.number.as;
+            new_number->flags |= value->flags & JSON_FLAG_INTEGER;
+            return new_number;
+        }
             
-        case JSON_STRING:
-            return create_json_string(value->value.string);
+        case JSON_STRING: {
+            JsonValue* new_string = create_json_string_len(value->value.string.data,
+                                                           value->value.string.length);
+            new_string->flags |= value->flags & JSON_FLAG_ESCAPED;
+            return new_string;
+        }
             
         case JSON_ARRAY: {
             JsonValue* new_array = create_json_array();
-            JsonArrayElement* elem = value->value.array;
-            while (elem != NULL) {
-                json_array_add(new_array, clone_json_value_internal(elem->value));
-                elem = elem->next;
+            size_t k;
+            json_array_reserve(new_array, value->value.array.length);
+            for (k = 0; k < value->value.array.length; k++) {
+                json_array_add(new_array, clone_json_value_internal(value->value.array.items[k]));
             }
             return new_array;
         }
         
         case JSON_OBJECT: {
             JsonValue* new_object = create_json_object();
-            JsonObjectMember* member;
-            
-            /* Iterate through hash table */
-            for (member = value->value.object; member != NULL; member = member->hh.next) {
-                json_object_add(new_object, member->key, 
-                              clone_json_value_internal(member->value));
+            size_t k;
+            json_object_reserve(new_object, value->value.object.length);
+            for (k = 0; k < value->value.object.length; k++) {
+                JsonObjectMember* member = &value->value.object.members[k];
+                json_object_add_member(new_object, member->key, member->key_length,
+                                       clone_json_value_internal(member->value));
             }
             return new_object;
         }
@@ -319,42 +726,53 @@ static JsonValue* clone_json_value_internal(JsonValue* value) {
 }
 
 /**
- * Free memory allocated for a JSON value and all its children.
- * UPGRADED: Properly frees hash table.
+ * Drop a reference to a JSON value. The last reference frees the value
+ * and releases its children.
  * 
- * @param value The JSON value to free
+ * @param value The JSON value to release
  */
 void free_json_value(JsonValue* value) {
     if (value == NULL) return;
     
+    /* Arena trees are released all at once by json_arena_destroy() */
+    if (value->flags & JSON_FLAG_ARENA) return;
+    
+    if (atomic_fetch_sub_explicit(&value->refcount, 1, memory_order_acq_rel) != 1) return;
+    
     switch (value->type) {
         case JSON_STRING:
-            free(value->value.string);
+            free((char*)value->value.string.data);
             break;
             
         case JSON_ARRAY:
             {
-                JsonArrayElement* elem = value->value.array;
-                while (elem != NULL) {
-                    JsonArrayElement* next = elem->next;
-                    free_json_value(elem->value);
-                    free(elem);
-                    elem = next;
+                size_t k;
+                JsonColumn* column = value->value.array.columns;
+                for (k = 0; k < value->value.array.length; k++) {
+                    free_json_value(value->value.array.items[k]);
+                }
+                free(value->value.array.items);
+                while (column != NULL) {
+                    JsonColumn* next = column->next;
+                    free(column->types);
+                    free(column->numbers);
+                    free(column);
+                    column = next;
                 }
             }
             break;
             
         case JSON_OBJECT:
             {
-                JsonObjectMember* member, *tmp;
-                
-                /* Delete all items from hash table */
-                HASH_ITER(hh, value->value.object, member, tmp) {
-                    HASH_DEL(value->value.object, member);
-                    free(member->key);
-                    free_json_value(member->value);
-                    free(member);
+                size_t k;
+                for (k = 0; k < value->value.object.length; k++) {
+                    if (value->value.object.members[k].key_copied) {
+                        free((char*)value->value.object.members[k].key);
+                    }
+                    free_json_value(value->value.object.members[k].value);
                 }
+                free(value->value.object.members);
+                free(value->value.object.index);
             }
             break;
             
@@ -365,6 +783,86 @@ void free_json_value(JsonValue* value) {
     free(value);
 }
 
+/**
+ * Add a reference to a JSON value.
+ * 
+ * @param value The value (may be NULL)
+ * @return The value
+ */
+JsonValue* json_value_retain(JsonValue* value) {
+    if (value != NULL && !(value->flags & JSON_FLAG_ARENA)) {
+        atomic_fetch_add_explicit(&value->refcount, 1, memory_order_relaxed);
+    }
+    return value;
+}
+
+/**
+ * A child for a container copied by json_value_unshare(): heap children
+ * are shared with a new reference, while arena children are deep-copied
+ * to the heap, since the arena goes away with its document.
+ */
+static JsonValue* unshare_child(JsonValue* child) {
+    if (child != NULL && (child->flags & JSON_FLAG_ARENA)) {
+        return clone_json_value_internal(child);
+    }
+    return json_value_retain(child);
+}
+
+/**
+ * Copy on write: get a version of a value that may be modified in place.
+ * A heap value the caller holds the only reference to is returned as is.
+ * Anything else (including arena values, which belong to their document)
+ * is replaced by a heap copy one level deep: a container's copy shares
+ * its heap children, so unsharing a nested value only copies the path
+ * down to it, and deep-copies the children that live in an arena. The
+ * caller's reference to the original is dropped.
+ * 
+ * @param value The value; the caller's reference is taken over
+ * @return A heap value the caller holds the only reference to
+ */
+JsonValue* json_value_unshare(JsonValue* value) {
+    JsonArena* arena;
+    JsonValue* copy;
+    size_t k;
+    
+    if (value == NULL) return NULL;
+    if (!(value->flags & JSON_FLAG_ARENA) &&
+        atomic_load_explicit(&value->refcount, memory_order_acquire) == 1) {
+        return value;
+    }
+    
+    /* The copy outlives any arena the original came from */
+    arena = json_arena_current();
+    json_arena_set_current(NULL);
+    switch (value->type) {
+        case JSON_ARRAY:
+            copy = create_json_array();
+            json_array_reserve(copy, value->value.array.length);
+            for (k = 0; k < value->value.array.length; k++) {
+                json_array_add(copy, unshare_child(value->value.array.items[k]));
+            }
+            break;
+            
+        case JSON_OBJECT:
+            copy = create_json_object();
+            json_object_reserve(copy, value->value.object.length);
+            for (k = 0; k < value->value.object.length; k++) {
+                JsonObjectMember* member = &value->value.object.members[k];
+                json_object_add_member(copy, member->key, member->key_length,
+                                       unshare_child(member->value));
+            }
+            break;
+            
+        default:
+            copy = clone_json_value_internal(value);
+            break;
+    }
+    json_arena_set_current(arena);
+    
+    free_json_value(value);
+    return copy;
+}
+
 /**
  * Evaluate a condition expression on a JSON value.
  * Used by select() filtering.
@@ -398,10 +896,12 @@ static int evaluate_condition(ConditionExpr* condition, JsonValue* item) {
                 "Condition type mismatch: expected NUMBER, got %s", 
                 get_type_name(result->type));
         log_execution(log_buffer);
+        free_json_value(result);
         return 0;
     }
     
-    double left_val = result->value.number;
+    double left_val = json_number_value(result);
+    free_json_value(result);
     double right_val = condition->value;
     
     const char* op_str = "?";
@@ -446,13 +946,27 @@ static int evaluate_condition(ConditionExpr* condition, JsonValue* item) {
     return eval_result;
 }
 
+/**
+ * Run the rest of a query on an intermediate result, then drop the
+ * reference to the intermediate result.
+ * 
+ * @param query The remaining query
+ * @param intermediate The intermediate result (its reference is taken over)
+ * @return A new reference to the result
+ */
+static JsonValue* execute_and_release(QueryNode* query, JsonValue* intermediate) {
+    JsonValue* result = execute_query_internal(query, intermediate);
+    free_json_value(intermediate);
+    return result;
+}
+
 /**
  * Internal query execution function (recursive for pipes).
  * VISUALIZATION: Logs each step of query execution.
  * 
  * @param query The query AST
- * @param json_data The JSON data to query
- * @return The result of the query
+ * @param json_data The JSON data to query (borrowed)
+ * @return A new reference to the result, or NULL on error
  */
 static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data) {
     char log_buffer[256];
@@ -464,7 +978,7 @@ static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data)
     
     if (query == NULL) {
         log_execution("Query chain complete: returning current value");
-        return json_data;
+        return json_value_retain(json_data);
     }
     
     switch (query->type) {
@@ -477,39 +991,39 @@ static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data)
             /* Field access: look up a key in an object */
             snprintf(log_buffer, sizeof(log_buffer), 
                     "Executing FIELD access: '%s' on %s", 
-                    query->data.field, get_type_name(json_data->type));
+                    query->data.field.name, get_type_name(json_data->type));
             log_execution(log_buffer);
             
             if (json_data->type != JSON_OBJECT) {
                 snprintf(log_buffer, sizeof(log_buffer), 
                         "ERROR: Cannot access field '%s' on %s (expected OBJECT)", 
-                        query->data.field, get_type_name(json_data->type));
+                        query->data.field.name, get_type_name(json_data->type));
                 log_execution(log_buffer);
                 
                 if (!g_visualize_mode) {
                     fprintf(stderr, "Error: Cannot access field '%s' on non-object\n", 
-                            query->data.field);
+                            query->data.field.name);
                 }
                 return NULL;
             }
             
-            /* Use hash table lookup (O(1)) */
-            JsonValue* result = json_object_get(json_data, query->data.field);
+            /* Length, hash and atom were computed when the query was parsed */
+            JsonValue* result = json_object_get_key(json_data, &query->data.field);
             if (result == NULL) {
                 snprintf(log_buffer, sizeof(log_buffer), 
-                        "ERROR: Field '%s' not found in object", query->data.field);
+                        "ERROR: Field '%s' not found in object", query->data.field.name);
                 log_execution(log_buffer);
                 
                 if (!g_visualize_mode) {
                     fprintf(stderr, "Error: Field '%s' not found in object\n", 
-                            query->data.field);
+                            query->data.field.name);
                 }
                 return NULL;
             }
             
             snprintf(log_buffer, sizeof(log_buffer), 
                     "Field '%s' found, type: %s", 
-                    query->data.field, get_type_name(result->type));
+                    query->data.field.name, get_type_name(result->type));
             log_execution(log_buffer);
             
             return execute_query_internal(query->next, result);
@@ -535,25 +1049,21 @@ static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data)
                 return NULL;
             }
             
-            JsonArrayElement* elem = json_data->value.array;
-            int idx = 0;
-            
-            while (elem != NULL) {
-                if (idx == query->data.index) {
-                    snprintf(log_buffer, sizeof(log_buffer), 
-                            "Index [%d] found, type: %s", 
-                            query->data.index, get_type_name(elem->value->type));
-                    log_execution(log_buffer);
-                    
-                    return execute_query_internal(query->next, elem->value);
-                }
-                elem = elem->next;
-                idx++;
+            /* Direct O(1) access into the element buffer */
+            int idx = query->data.index;
+            if (idx >= 0 && (size_t)idx < json_data->value.array.length) {
+                JsonValue* elem = json_data->value.array.items[idx];
+                snprintf(log_buffer, sizeof(log_buffer), 
+                        "Index [%d] found, type: %s", 
+                        query->data.index, get_type_name(elem->type));
+                log_execution(log_buffer);
+                
+                return execute_query_internal(query->next, elem);
             }
             
             snprintf(log_buffer, sizeof(log_buffer), 
                     "ERROR: Array index %d out of bounds (array size: %d)", 
-                    query->data.index, idx);
+                    query->data.index, (int)json_data->value.array.length);
             log_execution(log_buffer);
             
             if (!g_visualize_mode) {
@@ -583,19 +1093,14 @@ static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data)
             }
             
             JsonValue* result_array = create_json_array();
-            JsonArrayElement* elem = json_data->value.array;
-            int idx = 0;
+            int length = (int)json_data->value.array.length;
             int start = query->data.slice.start;
             int end = query->data.slice.end;
+            int idx;
             
-            /* Count array length if end is -1 (slice to end) */
+            /* An end of -1 means slice to the end of the array */
             if (end == -1) {
-                JsonArrayElement* temp = elem;
-                end = 0;
-                while (temp != NULL) {
-                    end++;
-                    temp = temp->next;
-                }
+                end = length;
                 snprintf(log_buffer, sizeof(log_buffer), 
                         "Slice end is -1, using array length: %d", end);
                 log_execution(log_buffer);
@@ -604,13 +1109,9 @@ static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data)
             int collected = 0;
             
             /* Collect elements in range [start, end) */
-            while (elem != NULL && idx < end) {
-                if (idx >= start) {
-                    json_array_add(result_array, clone_json_value_internal(elem->value));
-                    collected++;
-                }
-                elem = elem->next;
-                idx++;
+            for (idx = start < 0 ? 0 : start; idx < end && idx < length; idx++) {
+                json_array_add(result_array, json_value_retain(json_data->value.array.items[idx]));
+                collected++;
             }
             
             snprintf(log_buffer, sizeof(log_buffer), 
@@ -618,7 +1119,7 @@ static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data)
                     collected, start, end);
             log_execution(log_buffer);
             
-            return execute_query_internal(query->next, result_array);
+            return execute_and_release(query->next, result_array);
         }
         
         case QUERY_ARRAY_ITER: {
@@ -645,20 +1146,18 @@ static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data)
                 log_execution("Applying next operation to each array element");
                 
                 JsonValue* result_array = create_json_array();
-                JsonArrayElement* elem = json_data->value.array;
-                int elem_idx = 0;
+                int elem_idx;
                 
-                while (elem != NULL) {
+                for (elem_idx = 0; elem_idx < (int)json_data->value.array.length; elem_idx++) {
                     snprintf(log_buffer, sizeof(log_buffer), 
                             "Processing array element %d", elem_idx);
                     log_execution(log_buffer);
                     
-                    JsonValue* item_result = execute_query_internal(query->next, elem->value);
+                    JsonValue* item_result = execute_query_internal(query->next,
+                                                                    json_data->value.array.items[elem_idx]);
                     if (item_result != NULL) {
                         json_array_add(result_array, item_result);
                     }
-                    elem = elem->next;
-                    elem_idx++;
                 }
                 
                 snprintf(log_buffer, sizeof(log_buffer), 
@@ -669,7 +1168,7 @@ static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data)
             }
             
             log_execution("Array iteration complete: returning array as-is");
-            return json_data;
+            return json_value_retain(json_data);
         }
         
         case QUERY_SELECT: {
@@ -692,30 +1191,28 @@ static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data)
             }
             
             JsonValue* result_array = create_json_array();
-            JsonArrayElement* elem = json_data->value.array;
-            int elem_idx = 0;
+            int elem_idx;
             int passed = 0;
             
-            while (elem != NULL) {
+            for (elem_idx = 0; elem_idx < (int)json_data->value.array.length; elem_idx++) {
+                JsonValue* elem = json_data->value.array.items[elem_idx];
+                
                 snprintf(log_buffer, sizeof(log_buffer), 
                         "Evaluating filter condition on element %d", elem_idx);
                 log_execution(log_buffer);
                 
-                if (evaluate_condition(query->data.condition, elem->value)) {
+                if (evaluate_condition(query->data.condition, elem)) {
                     snprintf(log_buffer, sizeof(log_buffer), 
                             "Element %d PASSED filter", elem_idx);
                     log_execution(log_buffer);
                     
-                    json_array_add(result_array, clone_json_value_internal(elem->value));
+                    json_array_add(result_array, json_value_retain(elem));
                     passed++;
                 } else {
                     snprintf(log_buffer, sizeof(log_buffer), 
                             "Element %d FILTERED OUT", elem_idx);
                     log_execution(log_buffer);
                 }
-                
-                elem = elem->next;
-                elem_idx++;
             }
             
             snprintf(log_buffer, sizeof(log_buffer), 
@@ -723,7 +1220,7 @@ static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data)
                     passed, elem_idx);
             log_execution(log_buffer);
             
-            return execute_query_internal(query->next, result_array);
+            return execute_and_release(query->next, result_array);
         }
         
         case QUERY_PIPE: {
@@ -742,7 +1239,7 @@ static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data)
             log_execution(log_buffer);
             log_execution("Executing PIPE right-hand side");
             
-            JsonValue* final_result = execute_query_internal(query->data.pipe.right, left_result);
+            JsonValue* final_result = execute_and_release(query->data.pipe.right, left_result);
             
             if (final_result != NULL) {
                 snprintf(log_buffer, sizeof(log_buffer), 
@@ -754,7 +1251,7 @@ static JsonValue* execute_query_internal(QueryNode* query, JsonValue* json_data)
             
             /* Continue with any remaining operations */
             if (query->next != NULL) {
-                return execute_query_internal(query->next, final_result);
+                return execute_and_release(query->next, final_result);
             }
             
             return final_result;
@@ -820,7 +1317,7 @@ void free_query(QueryNode* query) {
     
     switch (query->type) {
         case QUERY_FIELD:
-            free(query->data.field);
+            free(query->data.field.name);
             break;
             
         case QUERY_PIPE:
@@ -843,6 +1340,29 @@ void free_query(QueryNode* query) {
     free_query(next);
 }
 
+/**
+ * Create a new query node for field access.
+ * The key's length and hash are computed here, once, and the name is
+ * interned so that lookups match document keys by pointer.
+ * 
+ * @param name The field name (owned by the node from now on)
+ */
+QueryNode* create_field_node(char* name) {
+    QueryNode* node = (QueryNode*)malloc(sizeof(QueryNode));
+    node->type = QUERY_FIELD;
+    node->data.field.name = name;
+    node->data.field.length = strlen(name);
+    node->data.field.hash = json_hash_key(name, node->data.field.length);
+    node->data.field.atom = json_atom_intern(name, node->data.field.length,
+                                             node->data.field.hash);
+    if (node->data.field.atom == NULL) {
+        node->data.field.atom = name;
+    }
+    atomic_init(&node->data.field.shape_cache, 0);
+    node->next = NULL;
+    return node;
+}
+
 /**
  * Create a new query node for pipe operation.
  */
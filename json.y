@@ -2,7 +2,7 @@
  * json.y
  * 
  * Bison parser specification for JSON.
- * UPGRADED VERSION using uthash for object member storage.
+ * Objects are built directly as flat member buffers.
  */
 
 %{
@@ -14,6 +14,7 @@
 /* Forward declarations */
 void json_yyerror(const char* s);
 int json_yylex(void);
+char* process_string(const char* str, int len);
 
 /* Global variable to hold the parsed JSON result */
 JsonValue* json_result = NULL;
@@ -21,24 +22,30 @@ JsonValue* json_result = NULL;
 
 /* Union to hold different types of values during parsing */
 %union {
-    double number;
-    char* string;
+    struct {
+        const char* data;               /* Token text in the input buffer */
+        size_t length;
+        int escaped;                    /* String contains escape sequences */
+    } span;
     JsonValue* value;
-    JsonObjectMember* object_member;
-    JsonArrayElement* array_element;
+    struct {
+        const char* key;                /* Key text (decoded if escaped) */
+        size_t key_length;
+        char* decoded;                  /* Buffer to free once the key is added */
+        JsonValue* value;
+    } member;
 }
 
 /* Token declarations */
 %token LBRACE RBRACE LBRACK RBRACK COMMA COLON
 %token TRUE FALSE NULL_TOKEN
 %token ERROR
-%token <number> NUMBER
-%token <string> STRING
+%token <span> NUMBER
+%token <span> STRING
 
 /* Non-terminal types */
-%type <value> json value object array
-%type <object_member> members member
-%type <array_element> elements
+%type <value> json value object array elements members
+%type <member> member
 
 /* Starting symbol */
 %start json
@@ -58,8 +65,8 @@ json:
 value:
     object                      { $$ = $1; }
     | array                     { $$ = $1; }
-    | STRING                    { $$ = create_json_string($1); free($1); }
-    | NUMBER                    { $$ = create_json_number($1); }
+    | STRING                    { $$ = create_json_string_span($1.data, $1.length, $1.escaped); }
+    | NUMBER                    { $$ = create_json_number_text($1.data, $1.length); }
     | TRUE                      { $$ = create_json_bool(1); }
     | FALSE                     { $$ = create_json_bool(0); }
     | NULL_TOKEN                { $$ = create_json_null(); }
@@ -67,40 +74,29 @@ value:
 
 /**
  * A JSON object: { members } or {}
- * UPGRADED: Now uses hash table instead of linked list.
  */
 object:
     LBRACE RBRACE               {
         $$ = create_json_object();
     }
     | LBRACE members RBRACE     {
-        JsonValue* obj = create_json_object();
-        
-        /* Add all members from linked list to hash table */
-        JsonObjectMember* current = $2;
-        while (current != NULL) {
-            JsonObjectMember* next = current->next;
-            current->next = NULL;  // Clear the temporary next pointer
-            
-            /* Add to hash table using uthash */
-            HASH_ADD_KEYPTR(hh, obj->value.object, current->key, 
-                           strlen(current->key), current);
-            
-            current = next;
-        }
-        
-        $$ = obj;
+        $$ = $2;
     }
     ;
 
 /**
- * Object members: one or more key-value pairs.
- * Built as temporary linked list during parsing, then added to hash table.
+ * Object members: one or more key-value pairs, added to the object in
+ * document order (left recursion keeps the parser stack flat).
  */
 members:
-    member                      { $$ = $1; }
-    | member COMMA members      {
-        $1->next = $3;
+    member                      {
+        $$ = create_json_object();
+        json_object_add_member($$, $1.key, $1.key_length, $1.value);
+        free($1.decoded);
+    }
+    | members COMMA member      {
+        json_object_add_member($1, $3.key, $3.key_length, $3.value);
+        free($3.decoded);
         $$ = $1;
     }
     ;
@@ -110,12 +106,18 @@ members:
  */
 member:
     STRING COLON value          {
-        JsonObjectMember* m = (JsonObjectMember*)malloc(sizeof(JsonObjectMember));
-        m->key = strdup($1);
-        m->value = $3;
-        m->next = NULL;
-        free($1);
-        $$ = m;
+        /* Keys are interned by the object, so only escaped keys need a
+         * buffer of their own for the decoded text */
+        if ($1.escaped) {
+            $$.decoded = process_string($1.data, (int)$1.length);
+            $$.key = $$.decoded;
+            $$.key_length = strlen($$.decoded);
+        } else {
+            $$.decoded = NULL;
+            $$.key = $1.data;
+            $$.key_length = $1.length;
+        }
+        $$.value = $3;
     }
     ;
 
@@ -127,27 +129,24 @@ array:
         $$ = create_json_array();
     }
     | LBRACK elements RBRACK    {
-        JsonValue* arr = create_json_array();
-        arr->value.array = $2;
-        $$ = arr;
+        $$ = $2;
     }
     ;
 
 /**
  * Array elements: one or more values.
+ * Left-recursive so each value is appended to the array as it is reduced,
+ * keeping the parser stack shallow for long arrays.
  */
 elements:
     value                       {
-        JsonArrayElement* e = (JsonArrayElement*)malloc(sizeof(JsonArrayElement));
-        e->value = $1;
-        e->next = NULL;
-        $$ = e;
+        JsonValue* arr = create_json_array();
+        json_array_add(arr, $1);
+        $$ = arr;
     }
-    | value COMMA elements      {
-        JsonArrayElement* e = (JsonArrayElement*)malloc(sizeof(JsonArrayElement));
-        e->value = $1;
-        e->next = $3;
-        $$ = e;
+    | elements COMMA value      {
+        json_array_add($1, $3);
+        $$ = $1;
     }
     ;
 
@@ -0,0 +1,232 @@
+/**
+ * json_arena.c
+ *
+ * Implementation of the per-document bump allocator.
+ * Chunks start small and double in size up to a cap, so a tiny document
+ * costs one small allocation and a huge one only a few dozen chunks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json_arena.h"
+
+#define ARENA_DEFAULT_CHUNK_SIZE  (64 * 1024)
+#define ARENA_MAX_CHUNK_SIZE      (16 * 1024 * 1024)
+#define ARENA_ALIGNMENT           8
+
+#ifdef _MSC_VER
+#define ARENA_THREAD_LOCAL __declspec(thread)
+#else
+#define ARENA_THREAD_LOCAL __thread
+#endif
+
+/* Arena that JSON values are currently allocated from (NULL = malloc).
+ * Per thread, so parallel workers each build into their own arena. */
+static ARENA_THREAD_LOCAL JsonArena* current_arena = NULL;
+
+/**
+ * Round a size up to the arena alignment.
+ */
+static size_t arena_align(size_t size) {
+    return (size + (ARENA_ALIGNMENT - 1)) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+/**
+ * Allocate a new chunk able to hold at least `min_size` bytes and make it
+ * the head of the arena.
+ */
+static JsonArenaChunk* arena_add_chunk(JsonArena* arena, size_t min_size) {
+    size_t size = arena->next_chunk_size;
+    while (size < min_size) {
+        size *= 2;
+    }
+
+    JsonArenaChunk* chunk = (JsonArenaChunk*)malloc(sizeof(JsonArenaChunk) + size);
+    if (chunk == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->last = NULL;
+    chunk->next = arena->head;
+    arena->head = chunk;
+
+    if (arena->next_chunk_size < ARENA_MAX_CHUNK_SIZE) {
+        arena->next_chunk_size *= 2;
+    }
+    return chunk;
+}
+
+/**
+ * Create a new, empty arena.
+ * The first chunk is allocated lazily on the first allocation.
+ *
+ * @param initial_size Size of the first chunk in bytes (0 for the default)
+ * @return The new arena
+ */
+JsonArena* json_arena_create(size_t initial_size) {
+    JsonArena* arena = (JsonArena*)malloc(sizeof(JsonArena));
+    if (arena == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    arena->head = NULL;
+    arena->next_chunk_size = initial_size ? initial_size : ARENA_DEFAULT_CHUNK_SIZE;
+    return arena;
+}
+
+/**
+ * Allocate memory from the arena.
+ *
+ * @param arena The arena to allocate from
+ * @param size Number of bytes required
+ * @return Pointer to the allocated memory
+ */
+void* json_arena_alloc(JsonArena* arena, size_t size) {
+    JsonArenaChunk* chunk = arena->head;
+    size = arena_align(size);
+
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        chunk = arena_add_chunk(arena, size);
+    }
+
+    char* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    chunk->last = ptr;
+    return ptr;
+}
+
+/**
+ * Grow an allocation made from the arena.
+ *
+ * @param arena The arena the block was allocated from
+ * @param ptr The block to grow (may be NULL)
+ * @param old_size Current size of the block
+ * @param new_size Required size of the block
+ * @return Pointer to the (possibly moved) block
+ */
+void* json_arena_realloc(JsonArena* arena, void* ptr, size_t old_size, size_t new_size) {
+    JsonArenaChunk* chunk = arena->head;
+
+    if (ptr == NULL) {
+        return json_arena_alloc(arena, new_size);
+    }
+    if (new_size <= old_size) {
+        return ptr;
+    }
+
+    /* The most recent allocation can simply be extended in place */
+    if (chunk != NULL && chunk->last == ptr) {
+        size_t offset = (size_t)((char*)ptr - chunk->data);
+        size_t needed = arena_align(new_size);
+        if (chunk->size - offset >= needed) {
+            chunk->used = offset + needed;
+            return ptr;
+        }
+    }
+
+    void* moved = json_arena_alloc(arena, new_size);
+    memcpy(moved, ptr, old_size);
+    return moved;
+}
+
+/**
+ * Release all allocations but keep the largest chunk for reuse.
+ *
+ * @param arena The arena to reset
+ */
+void json_arena_reset(JsonArena* arena) {
+    JsonArenaChunk* keep = arena->head;
+    JsonArenaChunk* chunk;
+
+    if (keep == NULL) return;
+
+    for (chunk = arena->head->next; chunk != NULL; chunk = chunk->next) {
+        if (chunk->size > keep->size) {
+            keep = chunk;
+        }
+    }
+
+    chunk = arena->head;
+    while (chunk != NULL) {
+        JsonArenaChunk* next = chunk->next;
+        if (chunk != keep) {
+            free(chunk);
+        }
+        chunk = next;
+    }
+    keep->next = NULL;
+    keep->used = 0;
+    keep->last = NULL;
+    arena->head = keep;
+}
+
+/**
+ * Free the arena and everything allocated from it.
+ *
+ * @param arena The arena to destroy
+ */
+void json_arena_destroy(JsonArena* arena) {
+    JsonArenaChunk* chunk;
+
+    if (arena == NULL) return;
+    if (current_arena == arena) {
+        current_arena = NULL;
+    }
+
+    chunk = arena->head;
+    while (chunk != NULL) {
+        JsonArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
+
+/**
+ * Select the arena JSON values are allocated from.
+ */
+void json_arena_set_current(JsonArena* arena) {
+    current_arena = arena;
+}
+
+/**
+ * Get the arena JSON values are currently allocated from.
+ */
+JsonArena* json_arena_current(void) {
+    return current_arena;
+}
+
+/**
+ * Allocate from the current arena, or with malloc if there is none.
+ *
+ * @param size Number of bytes required
+ * @return Pointer to the allocated memory
+ */
+void* json_alloc(size_t size) {
+    if (current_arena != NULL) {
+        return json_arena_alloc(current_arena, size);
+    }
+    return malloc(size);
+}
+
+/**
+ * Copy `len` bytes of a string into the current arena, or with malloc if
+ * there is none.
+ *
+ * @param str The bytes to copy (need not be NUL-terminated)
+ * @param len Number of bytes to copy
+ * @return The NUL-terminated copy
+ */
+char* json_strndup(const char* str, size_t len) {
+    char* copy = (char*)json_alloc(len + 1);
+    if (copy == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
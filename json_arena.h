@@ -0,0 +1,89 @@
+/**
+ * json_arena.h
+ *
+ * Bump allocator used for parsed JSON documents.
+ * Every node, object member and string of a document is carved out of a
+ * few large chunks, so building the tree is a pointer bump per node and
+ * tearing it down is a handful of chunk frees.
+ */
+
+#ifndef JSON_ARENA_H
+#define JSON_ARENA_H
+
+#include <stddef.h>
+
+/**
+ * A single chunk of arena memory. Chunks form a singly linked list,
+ * newest first; allocation always happens in the head chunk.
+ */
+typedef struct JsonArenaChunk {
+    struct JsonArenaChunk* next;        // Previously filled chunk
+    size_t size;                        // Usable bytes in data
+    size_t used;                        // Bytes handed out so far
+    char* last;                         // Start of the most recent allocation
+    char data[];                        // Chunk payload
+} JsonArenaChunk;
+
+/**
+ * A per-document arena.
+ */
+typedef struct JsonArena {
+    JsonArenaChunk* head;               // Chunk currently being filled
+    size_t next_chunk_size;             // Size of the next chunk to allocate
+} JsonArena;
+
+/**
+ * Create a new, empty arena.
+ *
+ * @param initial_size Size of the first chunk in bytes (0 for the default)
+ */
+JsonArena* json_arena_create(size_t initial_size);
+
+/**
+ * Allocate `size` bytes from the arena. The memory is suitably aligned for
+ * any JSON tree structure and lives until the arena is reset or destroyed.
+ */
+void* json_arena_alloc(JsonArena* arena, size_t size);
+
+/**
+ * Grow an allocation made from the arena. Extends in place when `ptr` is
+ * the most recent allocation and the chunk has room, otherwise copies.
+ */
+void* json_arena_realloc(JsonArena* arena, void* ptr, size_t old_size, size_t new_size);
+
+/**
+ * Release everything allocated from the arena but keep its largest chunk
+ * for reuse by the next document.
+ */
+void json_arena_reset(JsonArena* arena);
+
+/**
+ * Free the arena and all memory allocated from it.
+ */
+void json_arena_destroy(JsonArena* arena);
+
+/**
+ * Select the arena that JSON values are allocated from.
+ * While an arena is current, create_json_* and the parsers allocate from it;
+ * pass NULL to go back to individual malloc/free.
+ * The current arena is per thread.
+ */
+void json_arena_set_current(JsonArena* arena);
+
+/**
+ * Get the arena JSON values are currently allocated from, or NULL.
+ */
+JsonArena* json_arena_current(void);
+
+/**
+ * Allocate from the current arena, or with malloc if there is none.
+ */
+void* json_alloc(size_t size);
+
+/**
+ * Copy `len` bytes of a (not necessarily terminated) string into the
+ * current arena, or with malloc if there is none. The copy is terminated.
+ */
+char* json_strndup(const char* str, size_t len);
+
+#endif /* JSON_ARENA_H */
@@ -0,0 +1,183 @@
+/**
+ * json_atom.c
+ *
+ * Implementation of the interned key table.
+ * Atoms are carved out of a private arena and never freed. The table is an
+ * open-addressing array of atom pointers kept at most half full. In front
+ * of it every thread has a direct-mapped cache indexed by the key's hash,
+ * so the mutex is only taken the first time a thread meets a key (or when
+ * two keys it alternates between share a cache line).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "json_arena.h"
+#include "json_atom.h"
+
+#ifdef _MSC_VER
+#define ATOM_THREAD_LOCAL __declspec(thread)
+#else
+#define ATOM_THREAD_LOCAL __thread
+#endif
+
+#define ATOM_CACHE_SIZE 256             // Per-thread cache entries (a power of two)
+#define ATOM_INITIAL_CAPACITY 1024      // First table size (a power of two)
+
+/**
+ * An interned key. The text is NUL-terminated so atoms can also be used
+ * as C strings.
+ */
+typedef struct JsonAtom {
+    uint32_t hash;                      // json_hash_key() of the text
+    uint32_t length;                    // Length of the text in bytes
+    char text[];                        // The key
+} JsonAtom;
+
+static pthread_mutex_t atom_lock = PTHREAD_MUTEX_INITIALIZER;
+static JsonArena* atom_storage = NULL;  // Holds every atom
+static const JsonAtom** atom_table = NULL;
+static size_t atom_capacity = 0;
+static size_t atom_count = 0;
+
+/* Atoms this thread used last, indexed by hash */
+static ATOM_THREAD_LOCAL const JsonAtom* atom_cache[ATOM_CACHE_SIZE];
+
+/**
+ * Check whether an atom holds the given key.
+ */
+static int atom_matches(const JsonAtom* atom, const char* text, size_t length, uint32_t hash) {
+    return atom->hash == hash && atom->length == length &&
+           memcmp(atom->text, text, length) == 0;
+}
+
+/**
+ * Find a key in the table (caller holds the lock).
+ */
+static const JsonAtom* table_find(const char* text, size_t length, uint32_t hash) {
+    const JsonAtom* atom;
+    size_t mask;
+    size_t slot;
+
+    if (atom_capacity == 0) {
+        return NULL;
+    }
+
+    mask = atom_capacity - 1;
+    slot = hash & mask;
+    while ((atom = atom_table[slot]) != NULL) {
+        if (atom_matches(atom, text, length, hash)) {
+            return atom;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+/**
+ * Put an atom into the first free slot of its probe sequence (caller
+ * holds the lock).
+ */
+static void table_insert(const JsonAtom* atom) {
+    size_t mask = atom_capacity - 1;
+    size_t slot = atom->hash & mask;
+    while (atom_table[slot] != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    atom_table[slot] = atom;
+}
+
+/**
+ * Double the table and rehash every atom (caller holds the lock).
+ */
+static void table_grow(void) {
+    const JsonAtom** old_table = atom_table;
+    size_t old_capacity = atom_capacity;
+    size_t i;
+
+    atom_capacity = old_capacity ? old_capacity * 2 : ATOM_INITIAL_CAPACITY;
+    atom_table = (const JsonAtom**)calloc(atom_capacity, sizeof(JsonAtom*));
+    if (atom_table == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+
+    for (i = 0; i < old_capacity; i++) {
+        if (old_table[i] != NULL) {
+            table_insert(old_table[i]);
+        }
+    }
+    free(old_table);
+}
+
+/**
+ * Look up a key, first in this thread's cache and then in the table.
+ *
+ * @param create Nonzero to add the key if it is missing
+ */
+static const char* atom_lookup(const char* text, size_t length, uint32_t hash, int create) {
+    const JsonAtom** cached = &atom_cache[hash & (ATOM_CACHE_SIZE - 1)];
+    const JsonAtom* atom;
+
+    if (*cached != NULL && atom_matches(*cached, text, length, hash)) {
+        return (*cached)->text;
+    }
+    if (length > JSON_ATOM_MAX_LENGTH) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&atom_lock);
+    atom = table_find(text, length, hash);
+    if (atom == NULL && create && atom_count < JSON_ATOM_MAX_COUNT) {
+        JsonAtom* created;
+
+        if ((atom_count + 1) * 2 > atom_capacity) {
+            table_grow();
+        }
+        if (atom_storage == NULL) {
+            atom_storage = json_arena_create(0);
+        }
+
+        created = (JsonAtom*)json_arena_alloc(atom_storage, sizeof(JsonAtom) + length + 1);
+        created->hash = hash;
+        created->length = (uint32_t)length;
+        memcpy(created->text, text, length);
+        created->text[length] = '\0';
+
+        table_insert(created);
+        atom_count++;
+        atom = created;
+    }
+    pthread_mutex_unlock(&atom_lock);
+
+    if (atom == NULL) {
+        return NULL;
+    }
+    *cached = atom;
+    return atom->text;
+}
+
+/**
+ * Intern a key.
+ *
+ * @param text The key (not necessarily NUL-terminated)
+ * @param length Length of the key in bytes
+ * @param hash json_hash_key() of the key
+ * @return The atom's text, or NULL if the key cannot be interned
+ */
+const char* json_atom_intern(const char* text, size_t length, uint32_t hash) {
+    return atom_lookup(text, length, hash, 1);
+}
+
+/**
+ * Look up a key without interning it.
+ *
+ * @param text The key (not necessarily NUL-terminated)
+ * @param length Length of the key in bytes
+ * @param hash json_hash_key() of the key
+ * @return The atom's text, or NULL if the key has not been interned
+ */
+const char* json_atom_find(const char* text, size_t length, uint32_t hash) {
+    return atom_lookup(text, length, hash, 0);
+}
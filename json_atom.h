@@ -0,0 +1,47 @@
+/**
+ * json_atom.h
+ *
+ * Process-wide table of interned object keys ("atoms").
+ * Every distinct key is stored once, for the lifetime of the program, and
+ * shared by all documents, records and threads; objects point at the
+ * atom instead of keeping their own copy, and equal interned keys compare
+ * equal by pointer. The table is guarded by a mutex, but each thread keeps
+ * a small cache of the atoms it used last, so the common case of records
+ * repeating the same keys takes no lock.
+ */
+
+#ifndef JSON_ATOM_H
+#define JSON_ATOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Keys longer than this are not interned */
+#define JSON_ATOM_MAX_LENGTH 256
+
+/* Upper bound on the number of atoms, so inputs with unbounded distinct
+ * keys (e.g. maps keyed by ID) cannot grow the table forever */
+#define JSON_ATOM_MAX_COUNT (1 << 20)
+
+/**
+ * Intern a key.
+ *
+ * @param text The key (not necessarily NUL-terminated)
+ * @param length Length of the key in bytes
+ * @param hash json_hash_key() of the key
+ * @return The atom's NUL-terminated text, or NULL if the key is too long
+ *         or the table is full (the caller must then keep its own copy)
+ */
+const char* json_atom_intern(const char* text, size_t length, uint32_t hash);
+
+/**
+ * Look up a key without interning it.
+ *
+ * @param text The key (not necessarily NUL-terminated)
+ * @param length Length of the key in bytes
+ * @param hash json_hash_key() of the key
+ * @return The atom's text, or NULL if the key has not been interned
+ */
+const char* json_atom_find(const char* text, size_t length, uint32_t hash);
+
+#endif /* JSON_ATOM_H */
@@ -0,0 +1,278 @@
+/**
+ * json_filter.c
+ *
+ * Implementation of the select() comparison kernels.
+ *
+ * Every kernel fills whole 64-bit bitmap words from 64 rows at a time:
+ * the AVX2 kernels compare four doubles (or 32 type bytes) per
+ * instruction and the SSE2 kernels two doubles (or 16 type bytes),
+ * gathering the lane results with movemask. A trailing partial word is
+ * always finished by the scalar kernel, which builds its bits without
+ * branches. The kernels for one CPU are picked once, on first use.
+ *
+ * Build with -DJSON_NO_SIMD to force the scalar kernels, or -DJSON_NO_AVX2
+ * to stop at SSE2.
+ */
+
+#include <pthread.h>
+#include "json_filter.h"
+
+#if !defined(JSON_NO_SIMD) && defined(__SSE2__)
+#define JSON_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if !defined(JSON_NO_SIMD) && !defined(JSON_NO_AVX2) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define JSON_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define FILTER_OP_COUNT (CMP_NEQ + 1)
+
+typedef void (*CompareFn)(const double* values, size_t count, double operand,
+                          uint64_t* selection);
+typedef void (*TypeMaskFn)(const unsigned char* types, size_t count, unsigned char type,
+                           uint64_t* mask);
+
+/* Kernels selected for this CPU */
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+static CompareFn compare_kernels[FILTER_OP_COUNT];
+static TypeMaskFn type_mask_kernel = NULL;
+static const char* kernel_name = "scalar";
+
+/* ---- Scalar kernels ---- */
+
+#define SCALAR_COMPARE(name, OP)                                                  \
+static void name(const double* values, size_t count, double operand,              \
+                 uint64_t* selection) {                                           \
+    size_t i, j;                                                                  \
+    for (i = 0; i < count; i += 64) {                                             \
+        size_t rows = count - i < 64 ? count - i : 64;                            \
+        uint64_t word = 0;                                                        \
+        for (j = 0; j < rows; j++) {                                              \
+            word |= (uint64_t)(values[i + j] OP operand) << j;                    \
+        }                                                                         \
+        selection[i / 64] = word;                                                 \
+    }                                                                             \
+}
+
+SCALAR_COMPARE(compare_gt_scalar, >)
+SCALAR_COMPARE(compare_lt_scalar, <)
+SCALAR_COMPARE(compare_eq_scalar, ==)
+SCALAR_COMPARE(compare_gte_scalar, >=)
+SCALAR_COMPARE(compare_lte_scalar, <=)
+SCALAR_COMPARE(compare_neq_scalar, !=)
+
+static const CompareFn scalar_kernels[FILTER_OP_COUNT] = {
+    [CMP_GT] = compare_gt_scalar,
+    [CMP_LT] = compare_lt_scalar,
+    [CMP_EQ] = compare_eq_scalar,
+    [CMP_GTE] = compare_gte_scalar,
+    [CMP_LTE] = compare_lte_scalar,
+    [CMP_NEQ] = compare_neq_scalar,
+};
+
+static void type_mask_scalar(const unsigned char* types, size_t count, unsigned char type,
+                             uint64_t* mask) {
+    size_t i, j;
+    for (i = 0; i < count; i += 64) {
+        size_t rows = count - i < 64 ? count - i : 64;
+        uint64_t word = 0;
+        for (j = 0; j < rows; j++) {
+            word |= (uint64_t)(types[i + j] == type) << j;
+        }
+        mask[i / 64] = word;
+    }
+}
+
+/* ---- SSE2 kernels ---- */
+
+#ifdef JSON_HAVE_SSE2
+#define SSE2_COMPARE(name, CMP, tail)                                             \
+static void name(const double* values, size_t count, double operand,              \
+                 uint64_t* selection) {                                           \
+    const __m128d rhs = _mm_set1_pd(operand);                                     \
+    size_t full = count & ~(size_t)63;                                            \
+    size_t i, j;                                                                  \
+    for (i = 0; i < full; i += 64) {                                              \
+        uint64_t word = 0;                                                        \
+        for (j = 0; j < 64; j += 2) {                                             \
+            __m128d lhs = _mm_loadu_pd(values + i + j);                           \
+            word |= (uint64_t)_mm_movemask_pd(CMP(lhs, rhs)) << j;                \
+        }                                                                         \
+        selection[i / 64] = word;                                                 \
+    }                                                                             \
+    if (full < count) {                                                           \
+        tail(values + full, count - full, operand, selection + full / 64);        \
+    }                                                                             \
+}
+
+SSE2_COMPARE(compare_gt_sse2, _mm_cmpgt_pd, compare_gt_scalar)
+SSE2_COMPARE(compare_lt_sse2, _mm_cmplt_pd, compare_lt_scalar)
+SSE2_COMPARE(compare_eq_sse2, _mm_cmpeq_pd, compare_eq_scalar)
+SSE2_COMPARE(compare_gte_sse2, _mm_cmpge_pd, compare_gte_scalar)
+SSE2_COMPARE(compare_lte_sse2, _mm_cmple_pd, compare_lte_scalar)
+SSE2_COMPARE(compare_neq_sse2, _mm_cmpneq_pd, compare_neq_scalar)
+
+static const CompareFn sse2_kernels[FILTER_OP_COUNT] = {
+    [CMP_GT] = compare_gt_sse2,
+    [CMP_LT] = compare_lt_sse2,
+    [CMP_EQ] = compare_eq_sse2,
+    [CMP_GTE] = compare_gte_sse2,
+    [CMP_LTE] = compare_lte_sse2,
+    [CMP_NEQ] = compare_neq_sse2,
+};
+
+static void type_mask_sse2(const unsigned char* types, size_t count, unsigned char type,
+                           uint64_t* mask) {
+    const __m128i wanted = _mm_set1_epi8((char)type);
+    size_t full = count & ~(size_t)63;
+    size_t i, j;
+    for (i = 0; i < full; i += 64) {
+        uint64_t word = 0;
+        for (j = 0; j < 64; j += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)(types + i + j));
+            uint32_t bits = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, wanted));
+            word |= (uint64_t)bits << j;
+        }
+        mask[i / 64] = word;
+    }
+    if (full < count) {
+        type_mask_scalar(types + full, count - full, type, mask + full / 64);
+    }
+}
+#endif
+
+/* ---- AVX2 kernels ---- */
+
+#ifdef JSON_HAVE_AVX2
+#define AVX2_COMPARE(name, PREDICATE, tail)                                       \
+__attribute__((target("avx2")))                                                   \
+static void name(const double* values, size_t count, double operand,              \
+                 uint64_t* selection) {                                           \
+    const __m256d rhs = _mm256_set1_pd(operand);                                  \
+    size_t full = count & ~(size_t)63;                                            \
+    size_t i, j;                                                                  \
+    for (i = 0; i < full; i += 64) {                                              \
+        uint64_t word = 0;                                                        \
+        for (j = 0; j < 64; j += 4) {                                             \
+            __m256d lhs = _mm256_loadu_pd(values + i + j);                        \
+            __m256d hit = _mm256_cmp_pd(lhs, rhs, PREDICATE);                     \
+            word |= (uint64_t)_mm256_movemask_pd(hit) << j;                       \
+        }                                                                         \
+        selection[i / 64] = word;                                                 \
+    }                                                                             \
+    if (full < count) {                                                           \
+        tail(values + full, count - full, operand, selection + full / 64);        \
+    }                                                                             \
+}
+
+/* Ordered predicates, except != which is true for NaN as in C */
+AVX2_COMPARE(compare_gt_avx2, _CMP_GT_OQ, compare_gt_scalar)
+AVX2_COMPARE(compare_lt_avx2, _CMP_LT_OQ, compare_lt_scalar)
+AVX2_COMPARE(compare_eq_avx2, _CMP_EQ_OQ, compare_eq_scalar)
+AVX2_COMPARE(compare_gte_avx2, _CMP_GE_OQ, compare_gte_scalar)
+AVX2_COMPARE(compare_lte_avx2, _CMP_LE_OQ, compare_lte_scalar)
+AVX2_COMPARE(compare_neq_avx2, _CMP_NEQ_UQ, compare_neq_scalar)
+
+static const CompareFn avx2_kernels[FILTER_OP_COUNT] = {
+    [CMP_GT] = compare_gt_avx2,
+    [CMP_LT] = compare_lt_avx2,
+    [CMP_EQ] = compare_eq_avx2,
+    [CMP_GTE] = compare_gte_avx2,
+    [CMP_LTE] = compare_lte_avx2,
+    [CMP_NEQ] = compare_neq_avx2,
+};
+
+__attribute__((target("avx2")))
+static void type_mask_avx2(const unsigned char* types, size_t count, unsigned char type,
+                           uint64_t* mask) {
+    const __m256i wanted = _mm256_set1_epi8((char)type);
+    size_t full = count & ~(size_t)63;
+    size_t i;
+    for (i = 0; i < full; i += 64) {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)(types + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i*)(types + i + 32));
+        uint32_t lo_bits = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, wanted));
+        uint32_t hi_bits = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, wanted));
+        mask[i / 64] = (uint64_t)lo_bits | ((uint64_t)hi_bits << 32);
+    }
+    if (full < count) {
+        type_mask_scalar(types + full, count - full, type, mask + full / 64);
+    }
+}
+#endif
+
+/**
+ * Pick the widest kernels the CPU supports.
+ */
+static void select_kernels(void) {
+    const CompareFn* kernels = scalar_kernels;
+    int op;
+
+    kernel_name = "scalar";
+    type_mask_kernel = type_mask_scalar;
+#ifdef JSON_HAVE_SSE2
+    kernel_name = "sse2";
+    kernels = sse2_kernels;
+    type_mask_kernel = type_mask_sse2;
+#endif
+#ifdef JSON_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel_name = "avx2";
+        kernels = avx2_kernels;
+        type_mask_kernel = type_mask_avx2;
+    }
+#endif
+
+    for (op = 0; op < FILTER_OP_COUNT; op++) {
+        compare_kernels[op] = kernels[op];
+    }
+}
+
+/**
+ * Compare every value of a column with a constant.
+ *
+ * @param op The comparison (value op operand)
+ * @param values The column's values
+ * @param count Number of rows
+ * @param operand The constant right-hand side
+ * @param selection Receives JSON_FILTER_WORDS(count) words
+ */
+void json_filter_compare(ComparisonOp op, const double* values, size_t count,
+                         double operand, uint64_t* selection) {
+    size_t k;
+
+    pthread_once(&kernel_once, select_kernels);
+    if ((unsigned)op >= FILTER_OP_COUNT) {
+        for (k = 0; k < JSON_FILTER_WORDS(count); k++) {
+            selection[k] = 0;
+        }
+        return;
+    }
+    compare_kernels[op](values, count, operand, selection);
+}
+
+/**
+ * Mark the rows of a column whose type byte equals a given value.
+ *
+ * @param types The column's type bytes
+ * @param count Number of rows
+ * @param type The type to look for
+ * @param mask Receives JSON_FILTER_WORDS(count) words
+ */
+void json_filter_type_mask(const unsigned char* types, size_t count, unsigned char type,
+                           uint64_t* mask) {
+    pthread_once(&kernel_once, select_kernels);
+    type_mask_kernel(types, count, type, mask);
+}
+
+/**
+ * Name of the kernel selected for this CPU.
+ */
+const char* json_filter_kernel(void) {
+    pthread_once(&kernel_once, select_kernels);
+    return kernel_name;
+}
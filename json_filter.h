@@ -0,0 +1,52 @@
+/**
+ * json_filter.h
+ *
+ * Vectorized comparison kernels for select().
+ * A filter runs over a column of doubles (see JsonColumn) and produces a
+ * selection bitmap: bit k of word k / 64 is set when row k passes. Each
+ * ComparisonOp has its own kernel, so the loop body is a single SIMD
+ * compare rather than a switch per element. Like the structural indexer,
+ * the widest kernel the CPU supports (AVX2, SSE2 or scalar) is picked at
+ * run time.
+ */
+
+#ifndef JSON_FILTER_H
+#define JSON_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "json_value.h"
+
+/* Number of 64-bit words in a selection bitmap over n rows */
+#define JSON_FILTER_WORDS(n) (((n) + 63) / 64)
+
+/**
+ * Compare every value of a column with a constant.
+ * Bits past the last row of the final word are cleared.
+ *
+ * @param op The comparison (value op operand)
+ * @param values The column's values
+ * @param count Number of rows
+ * @param operand The constant right-hand side
+ * @param selection Receives JSON_FILTER_WORDS(count) words
+ */
+void json_filter_compare(ComparisonOp op, const double* values, size_t count,
+                         double operand, uint64_t* selection);
+
+/**
+ * Mark the rows of a column whose type byte equals a given value.
+ *
+ * @param types The column's type bytes
+ * @param count Number of rows
+ * @param type The type to look for (a JsonType or JSON_COLUMN_MISSING)
+ * @param mask Receives JSON_FILTER_WORDS(count) words
+ */
+void json_filter_type_mask(const unsigned char* types, size_t count, unsigned char type,
+                           uint64_t* mask);
+
+/**
+ * Name of the kernel selected for this CPU ("avx2", "sse2" or "scalar").
+ */
+const char* json_filter_kernel(void);
+
+#endif /* JSON_FILTER_H */
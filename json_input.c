@@ -0,0 +1,280 @@
+/**
+ * json_input.c
+ *
+ * Implementation of input loading: mmap for regular files, a read loop for
+ * everything else (and for platforms without mmap).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "json_input.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define INPUT_READ_CHUNK (64 * 1024)
+
+/**
+ * Read a whole stream into a heap buffer with zero padding.
+ * Used for pipes, terminals, stdin and as the portable fallback.
+ *
+ * @param input The input to fill
+ * @param file The stream to read
+ * @return 0 on success, -1 on error
+ */
+static int input_read_stream(JsonInput* input, FILE* file) {
+    size_t capacity = INPUT_READ_CHUNK;
+    size_t size = 0;
+    char* data = (char*)malloc(capacity + JSON_INPUT_PADDING);
+
+    if (data == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (;;) {
+        if (size == capacity) {
+            char* grown = (char*)realloc(data, capacity * 2 + JSON_INPUT_PADDING);
+            if (grown == NULL) {
+                free(data);
+                errno = ENOMEM;
+                return -1;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+
+        size_t n = fread(data + size, 1, capacity - size, file);
+        size += n;
+        if (n == 0) {
+            if (ferror(file)) {
+                free(data);
+                return -1;
+            }
+            break;
+        }
+    }
+
+    memset(data + size, 0, JSON_INPUT_PADDING);
+    input->data = data;
+    input->size = size;
+    input->mapped_size = 0;
+    return 0;
+}
+
+#ifndef _WIN32
+/**
+ * Map a regular file with zero padding after its last byte.
+ *
+ * @param input The input to fill
+ * @param fd Open descriptor of the file
+ * @param size Size of the file in bytes
+ * @return 0 on success, -1 if the file could not be mapped
+ */
+static int input_map_file(JsonInput* input, int fd, size_t size) {
+    size_t length = size + JSON_INPUT_PADDING;
+
+    /* Reserve room for the file plus padding; bytes past EOF read as zero */
+    char* base = (char*)mmap(NULL, length, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+
+    /* Private copy-on-write pages let the scanner write its temporary
+     * end-of-token NULs without touching the file */
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+             fd, 0) == MAP_FAILED) {
+        munmap(base, length);
+        return -1;
+    }
+
+#ifdef MADV_SEQUENTIAL
+    madvise(base, size, MADV_SEQUENTIAL);
+#endif
+
+    input->data = base;
+    input->size = size;
+    input->mapped_size = length;
+    return 0;
+}
+#endif
+
+/**
+ * Load a file for parsing.
+ *
+ * @param input The input to initialize
+ * @param filename Path of the file to load, or "-" for standard input
+ * @return 0 on success, -1 on error
+ */
+int json_input_open(JsonInput* input, const char* filename) {
+    if (strcmp(filename, "-") == 0) {
+        return input_read_stream(input, stdin);
+    }
+
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        if (input_map_file(input, fd, (size_t)st.st_size) == 0) {
+            close(fd);
+            return 0;
+        }
+    }
+
+    /* Not mappable (pipe, device, empty file...): read it instead */
+    FILE* file = fdopen(fd, "rb");
+    if (file == NULL) {
+        close(fd);
+        return -1;
+    }
+#else
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+#endif
+
+    int status = input_read_stream(input, file);
+    fclose(file);
+    return status;
+}
+
+/**
+ * Release an input buffer.
+ *
+ * @param input The input to release
+ */
+void json_input_close(JsonInput* input) {
+    if (input->data == NULL) return;
+
+#ifndef _WIN32
+    if (input->mapped_size > 0) {
+        munmap(input->data, input->mapped_size);
+        input->data = NULL;
+        return;
+    }
+#endif
+
+    free(input->data);
+    input->data = NULL;
+}
+
+/**
+ * Open a file for line-by-line reading.
+ *
+ * @param reader The reader to initialize
+ * @param filename Path of the file to read, or "-" for standard input
+ * @return 0 on success, -1 on error
+ */
+int json_line_reader_open(JsonLineReader* reader, const char* filename) {
+    if (strcmp(filename, "-") == 0) {
+        reader->file = stdin;
+    } else {
+        reader->file = fopen(filename, "rb");
+        if (reader->file == NULL) {
+            return -1;
+        }
+    }
+
+    reader->buffer = (char*)malloc(INPUT_READ_CHUNK);
+    if (reader->buffer == NULL) {
+        if (reader->file != stdin) fclose(reader->file);
+        errno = ENOMEM;
+        return -1;
+    }
+    reader->capacity = INPUT_READ_CHUNK;
+    reader->start = 0;
+    reader->end = 0;
+    reader->scanned = 0;
+    reader->line_number = 0;
+    reader->eof = 0;
+    return 0;
+}
+
+/**
+ * Read the next line.
+ *
+ * @param reader The reader
+ * @param line Receives a pointer to the line (without its newline)
+ * @param length Receives the line length
+ * @return 1 if a line was read, 0 at end of input, -1 on read error
+ */
+int json_line_reader_next(JsonLineReader* reader, const char** line, size_t* length) {
+    for (;;) {
+        char* from = reader->buffer + reader->start + reader->scanned;
+        char* newline = (char*)memchr(from, '\n', reader->end - reader->start - reader->scanned);
+
+        if (newline != NULL) {
+            *line = reader->buffer + reader->start;
+            *length = (size_t)(newline - *line);
+            reader->start += *length + 1;
+            reader->scanned = 0;
+            reader->line_number++;
+            return 1;
+        }
+        reader->scanned = reader->end - reader->start;
+
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return 0;
+            }
+            /* Last line without a trailing newline */
+            *line = reader->buffer + reader->start;
+            *length = reader->end - reader->start;
+            reader->start = reader->end;
+            reader->scanned = 0;
+            reader->line_number++;
+            return 1;
+        }
+
+        /* Move the partial line to the front, growing only if it fills the buffer */
+        if (reader->start > 0) {
+            memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->end == reader->capacity) {
+            char* grown = (char*)realloc(reader->buffer, reader->capacity * 2);
+            if (grown == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            reader->buffer = grown;
+            reader->capacity *= 2;
+        }
+
+        size_t n = fread(reader->buffer + reader->end, 1, reader->capacity - reader->end, reader->file);
+        reader->end += n;
+        if (n == 0) {
+            if (ferror(reader->file)) {
+                return -1;
+            }
+            reader->eof = 1;
+        }
+    }
+}
+
+/**
+ * Close a line reader.
+ *
+ * @param reader The reader to close
+ */
+void json_line_reader_close(JsonLineReader* reader) {
+    if (reader->file != NULL && reader->file != stdin) {
+        fclose(reader->file);
+    }
+    reader->file = NULL;
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
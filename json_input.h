@@ -0,0 +1,86 @@
+/**
+ * json_input.h
+ *
+ * Loading of JSON input files.
+ * Regular files are memory-mapped so the lexer reads straight from the page
+ * cache; pipes, terminals and stdin ("-") fall back to a single growable
+ * read buffer. Either way the bytes are followed by zero padding so the
+ * buffer can be handed to the flex scanner without another copy.
+ *
+ * Newline-delimited input (--lines) is instead read through a
+ * JsonLineReader, which streams the file and only ever holds the current
+ * record in memory.
+ */
+
+#ifndef JSON_INPUT_H
+#define JSON_INPUT_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Zero bytes guaranteed after the input (flex's yy_scan_buffer needs two) */
+#define JSON_INPUT_PADDING 2
+
+/**
+ * An input buffer, either mapped or read into memory.
+ */
+typedef struct JsonInput {
+    char* data;                         // Input bytes followed by JSON_INPUT_PADDING zeros
+    size_t size;                        // Number of input bytes (excluding padding)
+    size_t mapped_size;                 // Length of the mapping, 0 for a heap buffer
+} JsonInput;
+
+/**
+ * Streaming reader for newline-delimited input.
+ */
+typedef struct JsonLineReader {
+    FILE* file;                         // Stream being read
+    char* buffer;                       // Holds the current line and read-ahead
+    size_t capacity;                    // Allocated size of buffer
+    size_t start;                       // Start of the unconsumed bytes
+    size_t end;                         // End of the bytes read so far
+    size_t scanned;                     // Bytes after start already searched for '\n'
+    size_t line_number;                 // 1-based number of the last line returned
+    int eof;                            // Set once the stream is exhausted
+} JsonLineReader;
+
+/**
+ * Load a file for parsing. Pass "-" to read standard input.
+ *
+ * @param input The input to initialize
+ * @param filename Path of the file to load
+ * @return 0 on success, -1 on error (errno describes the failure)
+ */
+int json_input_open(JsonInput* input, const char* filename);
+
+/**
+ * Release an input buffer loaded with json_input_open().
+ */
+void json_input_close(JsonInput* input);
+
+/**
+ * Open a file for line-by-line reading. Pass "-" to read standard input.
+ *
+ * @param reader The reader to initialize
+ * @param filename Path of the file to read
+ * @return 0 on success, -1 on error (errno describes the failure)
+ */
+int json_line_reader_open(JsonLineReader* reader, const char* filename);
+
+/**
+ * Read the next line. The returned bytes exclude the newline and stay
+ * valid until the next call. Memory use is bounded by the longest line.
+ *
+ * @param reader The reader
+ * @param line Receives a pointer to the line
+ * @param length Receives the line length
+ * @return 1 if a line was read, 0 at end of input, -1 on read error
+ */
+int json_line_reader_next(JsonLineReader* reader, const char** line, size_t* length);
+
+/**
+ * Close a reader opened with json_line_reader_open().
+ */
+void json_line_reader_close(JsonLineReader* reader);
+
+#endif /* JSON_INPUT_H */
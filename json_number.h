@@ -0,0 +1,63 @@
+/**
+ * json_number.h
+ *
+ * Conversion of JSON number literals, and formatting of numbers for output.
+ * Integral literals that fit in 64 bits are converted exactly as integers;
+ * everything else goes through Clinger's fast path, then the Eisel-Lemire
+ * algorithm, and only falls back to strtod() for the rare inputs neither
+ * can decide. The result never depends on the current locale's decimal
+ * point (the program does not call setlocale, so the strtod fallback runs
+ * in the "C" locale).
+ *
+ * Doubles are printed with the fewest digits that read back as the same
+ * value, found with Grisu3 (or, for the values it cannot decide, the
+ * shortest strtod-checked printf precision), and integers with a table of digit pairs.
+ */
+
+#ifndef JSON_NUMBER_H
+#define JSON_NUMBER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Convert a JSON number literal.
+ * The text must already match the JSON number grammar; it does not need
+ * to be NUL-terminated.
+ *
+ * @param text The literal
+ * @param length Length of the literal in bytes
+ * @param real Receives the value as a correctly rounded double
+ * @param integer Receives the exact value if the literal is an integer
+ *                that fits in an int64_t
+ * @return 1 if *integer was set, 0 otherwise
+ */
+int json_number_convert(const char* text, size_t length, double* real, int64_t* integer);
+
+/* Buffer size that holds any formatted number */
+#define JSON_NUMBER_BUFFER_SIZE 32
+
+/**
+ * Format a 64-bit integer in decimal.
+ *
+ * @param value The integer
+ * @param out Buffer of at least JSON_NUMBER_BUFFER_SIZE bytes; the result
+ *            is not NUL-terminated
+ * @return Number of characters written
+ */
+size_t json_number_format_int64(int64_t value, char* out);
+
+/**
+ * Format a double as the shortest decimal that reads back as the same
+ * value, laid out like printf's %g (integral values below 1e17 in full).
+ * Infinity is printed as the nearest finite value so the output stays
+ * valid JSON.
+ *
+ * @param value The number
+ * @param out Buffer of at least JSON_NUMBER_BUFFER_SIZE bytes; the result
+ *            is not NUL-terminated
+ * @return Number of characters written
+ */
+size_t json_number_format_double(double value, char* out);
+
+#endif /* JSON_NUMBER_H */
@@ -0,0 +1,326 @@
+/**
+ * json_output.c
+ *
+ * Implementation of the buffered output writer.
+ *
+ * Strings are escaped by scanning for the next byte that needs an escape
+ * (a quote, a backslash or a control character) 32 bytes at a time with
+ * AVX2 or 16 with SSE2, and copying the clean run before it in one go.
+ * Build with -DJSON_NO_SIMD to force the scalar scan, or -DJSON_NO_AVX2
+ * to stop at SSE2.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include "json_output.h"
+
+#if !defined(JSON_NO_SIMD) && defined(__SSE2__)
+#define JSON_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if !defined(JSON_NO_SIMD) && !defined(JSON_NO_AVX2) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define JSON_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#define OUTPUT_WRITE(fd, data, length) _write(fd, data, (unsigned int)(length))
+#define OUTPUT_ISATTY(fd) _isatty(fd)
+#else
+#include <unistd.h>
+#define OUTPUT_WRITE(fd, data, length) write(fd, data, length)
+#define OUTPUT_ISATTY(fd) isatty(fd)
+#endif
+
+#define OUTPUT_FD 1
+#define OUTPUT_SPACES 128
+
+JsonOutput json_output;
+
+static const char spaces[OUTPUT_SPACES + 1] =
+    "                                                                "
+    "                                                                ";
+
+static const char hex_digits[] = "0123456789abcdef";
+
+typedef const char* (*FindEscapeFn)(const char* p, const char* end, int escaped);
+
+/* Scanner selected for this CPU */
+static FindEscapeFn find_escape = NULL;
+
+/* -1 until standard output has been checked, then 0 or 1 */
+static int output_is_terminal = -1;
+
+/**
+ * Write bytes straight to standard output, retrying short writes.
+ * Errors (e.g. a closed pipe) drop the output, as stdio would.
+ */
+static void write_all(const char* data, size_t length) {
+    while (length > 0) {
+        long written = (long)OUTPUT_WRITE(OUTPUT_FD, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+}
+
+/**
+ * Write everything buffered to standard output.
+ */
+void json_output_flush(void) {
+    fflush(stdout);
+    write_all(json_output.data, json_output.length);
+    json_output.length = 0;
+}
+
+/**
+ * Append bytes that do not fit in the buffer's free space: the buffer is
+ * flushed, then blocks as large as the buffer are written directly.
+ *
+ * @param data The bytes
+ * @param length Number of bytes
+ */
+void json_output_write_large(const char* data, size_t length) {
+    json_output_flush();
+    if (length >= JSON_OUTPUT_BUFFER_SIZE) {
+        write_all(data, length);
+        return;
+    }
+    memcpy(json_output.data, data, length);
+    json_output.length = length;
+}
+
+/**
+ * Append `count` spaces of indentation.
+ *
+ * @param count Number of spaces
+ */
+void json_output_indent(int count) {
+    while (count > OUTPUT_SPACES) {
+        json_output_write(spaces, OUTPUT_SPACES);
+        count -= OUTPUT_SPACES;
+    }
+    if (count > 0) {
+        json_output_write(spaces, (size_t)count);
+    }
+}
+
+/**
+ * End a line of output, flushing when standard output is a terminal.
+ */
+void json_output_line_end(void) {
+    json_output_char('\n');
+    if (output_is_terminal < 0) {
+        output_is_terminal = OUTPUT_ISATTY(OUTPUT_FD) ? 1 : 0;
+    }
+    if (output_is_terminal) {
+        json_output_flush();
+    }
+}
+
+#ifndef JSON_HAVE_SSE2
+/*
+ * Bytes that need an escape in a JSON string: control characters (1)
+ * and quotes and backslashes (2). In an escaped span only class 1
+ * counts, since quotes and backslashes belong to escape sequences.
+ */
+#define ESCAPE_CONTROL 1
+#define ESCAPE_SYNTAX  2
+#define ESCAPE_CONTROL_ROW ESCAPE_CONTROL, ESCAPE_CONTROL, ESCAPE_CONTROL, ESCAPE_CONTROL, \
+                           ESCAPE_CONTROL, ESCAPE_CONTROL, ESCAPE_CONTROL, ESCAPE_CONTROL, \
+                           ESCAPE_CONTROL, ESCAPE_CONTROL, ESCAPE_CONTROL, ESCAPE_CONTROL, \
+                           ESCAPE_CONTROL, ESCAPE_CONTROL, ESCAPE_CONTROL, ESCAPE_CONTROL
+
+static const unsigned char escape_class[256] = {
+    ESCAPE_CONTROL_ROW, ESCAPE_CONTROL_ROW,
+    ['"'] = ESCAPE_SYNTAX,
+    ['\\'] = ESCAPE_SYNTAX
+};
+
+/**
+ * Scalar scan for the first byte that needs an escape.
+ *
+ * @param escaped Nonzero to look for control characters only
+ * @return The byte's position, or `end` if there is none
+ */
+static const char* find_escape_scalar(const char* p, const char* end, int escaped) {
+    unsigned char wanted = escaped ? ESCAPE_CONTROL : (ESCAPE_CONTROL | ESCAPE_SYNTAX);
+
+    while (p < end && !(escape_class[(unsigned char)*p] & wanted)) {
+        p++;
+    }
+    return p;
+}
+#endif
+
+#ifdef JSON_HAVE_SSE2
+/* Comparison operands for the vector scans, filled in once by
+ * select_scanner() rather than built with set1 on every call */
+static char quote_lane[32];
+static char bslash_lane[32];
+static char control_lane[32];
+
+/**
+ * SSE2 scan: 16 bytes per step. Control characters are the bytes whose
+ * unsigned maximum with 0x1F is still 0x1F. A short tail is copied into a
+ * padded block and checked in one more step, with the padding masked off.
+ */
+static const char* find_escape_sse2(const char* p, const char* end, int escaped) {
+    /* For escaped spans the quote and backslash tests repeat a control one */
+    const __m128i quote = _mm_loadu_si128((const __m128i*)(escaped ? control_lane : quote_lane));
+    const __m128i bslash = _mm_loadu_si128((const __m128i*)(escaped ? control_lane : bslash_lane));
+    const __m128i control = _mm_loadu_si128((const __m128i*)control_lane);
+    char tail[16];
+
+    for (;;) {
+        size_t remaining = (size_t)(end - p);
+        const char* block = p;
+        unsigned valid = 0xFFFF;
+        if (remaining == 0) {
+            return end;
+        }
+        if (remaining < 16) {
+            memcpy(tail, p, remaining);
+            block = tail;
+            valid = (1u << remaining) - 1;
+        }
+
+        __m128i v = _mm_loadu_si128((const __m128i*)block);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                                _mm_cmpeq_epi8(v, bslash)),
+                                   _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit) & valid;
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        if (remaining <= 16) {
+            return end;
+        }
+        p += 16;
+    }
+}
+#endif
+
+#ifdef JSON_HAVE_AVX2
+/**
+ * AVX2 scan: 32 bytes per step, with the tail handled like the SSE2
+ * scan's. Compiled for AVX2 regardless of the global target and only
+ * used when the CPU reports support.
+ */
+__attribute__((target("avx2")))
+static const char* find_escape_avx2(const char* p, const char* end, int escaped) {
+    const __m256i quote = _mm256_loadu_si256((const __m256i*)(escaped ? control_lane : quote_lane));
+    const __m256i bslash = _mm256_loadu_si256((const __m256i*)(escaped ? control_lane : bslash_lane));
+    const __m256i control = _mm256_loadu_si256((const __m256i*)control_lane);
+    char tail[32];
+
+    for (;;) {
+        size_t remaining = (size_t)(end - p);
+        const char* block = p;
+        unsigned valid = 0xFFFFFFFFu;
+        if (remaining == 0) {
+            return end;
+        }
+        if (remaining < 32) {
+            memcpy(tail, p, remaining);
+            block = tail;
+            valid = (1u << remaining) - 1;
+        }
+
+        __m256i v = _mm256_loadu_si256((const __m256i*)block);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                      _mm256_cmpeq_epi8(v, bslash)),
+                                      _mm256_cmpeq_epi8(_mm256_max_epu8(v, control), control));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit) & valid;
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        if (remaining <= 32) {
+            return end;
+        }
+        p += 32;
+    }
+}
+#endif
+
+/**
+ * Pick the widest scanner the CPU supports.
+ */
+static void select_scanner(void) {
+#ifdef JSON_HAVE_SSE2
+    memset(quote_lane, '"', sizeof(quote_lane));
+    memset(bslash_lane, '\\', sizeof(bslash_lane));
+    memset(control_lane, 0x1F, sizeof(control_lane));
+#endif
+#ifdef JSON_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_escape = find_escape_avx2;
+        return;
+    }
+#endif
+#ifdef JSON_HAVE_SSE2
+    find_escape = find_escape_sse2;
+#else
+    find_escape = find_escape_scalar;
+#endif
+}
+
+/**
+ * Append the escape sequence for one byte.
+ *
+ * @param c A quote, backslash or control character
+ */
+static void write_escape(unsigned char c) {
+    switch (c) {
+        case '"':  JSON_OUTPUT_LITERAL("\\\""); return;
+        case '\\': JSON_OUTPUT_LITERAL("\\\\"); return;
+        case '\b': JSON_OUTPUT_LITERAL("\\b"); return;
+        case '\f': JSON_OUTPUT_LITERAL("\\f"); return;
+        case '\n': JSON_OUTPUT_LITERAL("\\n"); return;
+        case '\r': JSON_OUTPUT_LITERAL("\\r"); return;
+        case '\t': JSON_OUTPUT_LITERAL("\\t"); return;
+        default: {
+            char escape[6] = { '\\', 'u', '0', '0', hex_digits[c >> 4], hex_digits[c & 0xF] };
+            json_output_write(escape, sizeof(escape));
+            return;
+        }
+    }
+}
+
+/**
+ * Append a string as a quoted JSON string. Runs without special bytes are
+ * copied whole; quotes, backslashes and control characters are escaped.
+ * With `escaped` set the text is an escaped span from the input: its
+ * escape sequences are copied as they are and only raw control
+ * characters (which the parsers let through) are escaped, so the scan
+ * does not stop at every backslash.
+ *
+ * @param data The string's bytes
+ * @param length Number of bytes
+ * @param escaped Nonzero if the text already holds escape sequences
+ */
+void json_output_string(const char* data, size_t length, int escaped) {
+    const char* p = data;
+    const char* end = data + length;
+
+    if (find_escape == NULL) {
+        select_scanner();
+    }
+
+    json_output_char('"');
+    for (;;) {
+        const char* special = find_escape(p, end, escaped);
+        json_output_write(p, (size_t)(special - p));
+        if (special == end) break;
+        write_escape((unsigned char)*special);
+        p = special + 1;
+    }
+    json_output_char('"');
+}
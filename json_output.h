@@ -0,0 +1,89 @@
+/**
+ * json_output.h
+ *
+ * Buffered writer for query results.
+ * Printed JSON collects in one large buffer and leaves in a single
+ * write(2) per flush instead of a stdio call per token; literals are
+ * copied with memcpy and indentation from a precomputed run of spaces.
+ * Only one thread prints at a time (the main thread), so the buffer is
+ * shared.
+ *
+ * The buffer bypasses stdout's stdio buffer. json_output_flush() flushes
+ * stdio first, so output printed with printf() before buffered output
+ * stays in order; code that goes back to printf() afterwards must call
+ * json_output_flush() first.
+ */
+
+#ifndef JSON_OUTPUT_H
+#define JSON_OUTPUT_H
+
+#include <stddef.h>
+#include <string.h>
+
+#define JSON_OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/**
+ * The output buffer.
+ */
+typedef struct JsonOutput {
+    char data[JSON_OUTPUT_BUFFER_SIZE];
+    size_t length;                      // Bytes waiting to be written
+} JsonOutput;
+
+extern JsonOutput json_output;
+
+/**
+ * Write everything buffered to standard output (after anything pending
+ * in stdout's stdio buffer).
+ */
+void json_output_flush(void);
+
+/**
+ * Append bytes that do not fit in the buffer's free space.
+ */
+void json_output_write_large(const char* data, size_t length);
+
+/**
+ * Append `count` spaces of indentation.
+ */
+void json_output_indent(int count);
+
+/**
+ * End a line of output. Flushes when standard output is a terminal, so
+ * results still show up one line at a time there.
+ */
+void json_output_line_end(void);
+
+/**
+ * Append a string as a quoted, escaped JSON string. Set `escaped` for
+ * text that already holds escape sequences (an escaped span from the
+ * input).
+ */
+void json_output_string(const char* data, size_t length, int escaped);
+
+/**
+ * Append bytes to the output.
+ */
+static inline void json_output_write(const char* data, size_t length) {
+    if (length <= JSON_OUTPUT_BUFFER_SIZE - json_output.length) {
+        memcpy(json_output.data + json_output.length, data, length);
+        json_output.length += length;
+    } else {
+        json_output_write_large(data, length);
+    }
+}
+
+/**
+ * Append one byte to the output.
+ */
+static inline void json_output_char(char c) {
+    if (json_output.length == JSON_OUTPUT_BUFFER_SIZE) {
+        json_output_flush();
+    }
+    json_output.data[json_output.length++] = c;
+}
+
+/* Append a string literal (its length is known at compile time) */
+#define JSON_OUTPUT_LITERAL(text) json_output_write(text, sizeof(text) - 1)
+
+#endif /* JSON_OUTPUT_H */
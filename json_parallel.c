@@ -0,0 +1,389 @@
+/**
+ * json_parallel.c
+ *
+ * Implementation of multi-threaded NDJSON processing.
+ *
+ * A fixed pool of chunk slots cycles between the main thread and the
+ * workers: the main thread fills a free slot with whole lines and queues
+ * it, a worker parses and queries every line of the slot into the slot's
+ * arena, and the main thread prints the slot's results and frees it again.
+ * The engine and the fast parser keep no global state and the current
+ * arena is per thread, so workers share nothing but the read-only query.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "json_value.h"
+#include "json_input.h"
+#include "json_parser.h"
+#include "json_structural.h"
+#include "json_parallel.h"
+#include "json_output.h"
+
+/* Target number of input bytes per chunk */
+#define PARALLEL_CHUNK_SIZE (1024 * 1024)
+
+/* Chunk slots per worker (bounds memory and keeps workers busy) */
+#define PARALLEL_SLOTS_PER_THREAD 2
+
+typedef enum {
+    SLOT_FREE,                          // Owned by the main thread, empty
+    SLOT_QUEUED,                        // Filled, waiting for a worker
+    SLOT_RUNNING,                       // Being processed by a worker
+    SLOT_DONE                           // Results ready to print
+} SlotState;
+
+/**
+ * Outcome of one record.
+ */
+typedef struct ParallelRecord {
+    JsonValue* result;                  // Query result, or NULL on error
+    size_t line;                        // Input line number
+    int error;                          // 0, RECORD_PARSE_ERROR or RECORD_QUERY_ERROR
+} ParallelRecord;
+
+#define RECORD_PARSE_ERROR 1
+#define RECORD_QUERY_ERROR 2
+
+/**
+ * A chunk of whole input lines and the results computed from it.
+ */
+typedef struct ParallelSlot {
+    SlotState state;
+    size_t seq;                         // Position of the chunk in the input
+    char* data;                         // Lines, each terminated by '\n'
+    size_t size;                        // Bytes used in data
+    size_t capacity;                    // Allocated size of data
+    size_t first_line;                  // Line number of the first line
+    JsonArena* arena;                   // Holds the chunk's values and results
+    ParallelRecord* records;            // Per-record outcomes
+    size_t record_count;
+    size_t record_capacity;
+} ParallelSlot;
+
+/**
+ * State shared between the main thread and the workers.
+ */
+typedef struct ParallelPool {
+    QueryProgram* program;              // The query, compiled once for all workers
+    JsonProjection* projection;         // Parts of each record the query reaches
+    ParallelSlot* slots;
+    int slot_count;
+    int shutdown;                       // Set when no more chunks will be queued
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;          // A slot became QUEUED (or shutdown)
+    pthread_cond_t work_done;           // A slot became DONE
+} ParallelPool;
+
+/**
+ * Append a record outcome to a slot.
+ */
+static void slot_add_record(ParallelSlot* slot, JsonValue* result, size_t line, int error) {
+    if (slot->record_count == slot->record_capacity) {
+        size_t capacity = slot->record_capacity ? slot->record_capacity * 2 : 256;
+        ParallelRecord* records = (ParallelRecord*)realloc(slot->records,
+                                                           capacity * sizeof(ParallelRecord));
+        if (records == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            exit(1);
+        }
+        slot->records = records;
+        slot->record_capacity = capacity;
+    }
+
+    ParallelRecord* record = &slot->records[slot->record_count++];
+    record->result = result;
+    record->line = line;
+    record->error = error;
+}
+
+/**
+ * Append one line (plus a newline) to a slot's buffer.
+ */
+static void slot_add_line(ParallelSlot* slot, const char* line, size_t length) {
+    if (slot->size + length + 1 > slot->capacity) {
+        size_t capacity = slot->capacity ? slot->capacity : PARALLEL_CHUNK_SIZE;
+        while (capacity < slot->size + length + 1) {
+            capacity *= 2;
+        }
+        char* data = (char*)realloc(slot->data, capacity);
+        if (data == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            exit(1);
+        }
+        slot->data = data;
+        slot->capacity = capacity;
+    }
+
+    memcpy(slot->data + slot->size, line, length);
+    slot->size += length;
+    slot->data[slot->size++] = '\n';
+}
+
+/**
+ * Check whether a line holds nothing but whitespace.
+ */
+static int is_blank(const char* line, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Parse and query every line of a slot (runs on a worker thread).
+ */
+static void process_slot(ParallelPool* pool, ParallelSlot* slot) {
+    const char* p = slot->data;
+    const char* end = slot->data + slot->size;
+    size_t line = slot->first_line;
+
+    json_arena_set_current(slot->arena);
+
+    while (p < end) {
+        const char* newline = (const char*)memchr(p, '\n', (size_t)(end - p));
+        size_t length = (size_t)(newline - p);
+
+        if (!is_blank(p, length)) {
+            JsonValue* record = json_parse_projected(p, length, pool->projection);
+            if (record == NULL) {
+                slot_add_record(slot, NULL, line, RECORD_PARSE_ERROR);
+            } else {
+                JsonValue* result = execute_program(pool->program, record);
+                slot_add_record(slot, result, line, result == NULL ? RECORD_QUERY_ERROR : 0);
+            }
+        }
+
+        p = newline + 1;
+        line++;
+    }
+
+    json_arena_set_current(NULL);
+}
+
+/**
+ * Worker thread: take queued slots in input order until shutdown.
+ */
+static void* worker_main(void* arg) {
+    ParallelPool* pool = (ParallelPool*)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        ParallelSlot* next = NULL;
+        int i;
+
+        for (i = 0; i < pool->slot_count; i++) {
+            ParallelSlot* slot = &pool->slots[i];
+            if (slot->state == SLOT_QUEUED && (next == NULL || slot->seq < next->seq)) {
+                next = slot;
+            }
+        }
+
+        if (next == NULL) {
+            if (pool->shutdown) break;
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+            continue;
+        }
+
+        next->state = SLOT_RUNNING;
+        pthread_mutex_unlock(&pool->lock);
+
+        process_slot(pool, next);
+
+        pthread_mutex_lock(&pool->lock);
+        next->state = SLOT_DONE;
+        pthread_cond_broadcast(&pool->work_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/**
+ * Print a finished slot's results and report its failed records.
+ *
+ * @return 1 if any record failed, 0 otherwise
+ */
+static int print_slot(ParallelSlot* slot) {
+    int failed = 0;
+    size_t i;
+
+    for (i = 0; i < slot->record_count; i++) {
+        ParallelRecord* record = &slot->records[i];
+        if (record->error == RECORD_PARSE_ERROR) {
+            fprintf(stderr, "Error: Failed to parse JSON on line %lu\n", (unsigned long)record->line);
+            failed = 1;
+        } else if (record->error == RECORD_QUERY_ERROR) {
+            fprintf(stderr, "Error: Query execution failed on line %lu\n", (unsigned long)record->line);
+            failed = 1;
+        } else {
+            print_json_result(record->result, 0);
+            json_output_line_end();
+            free_json_value(record->result);
+        }
+    }
+
+    return failed;
+}
+
+/**
+ * Find a slot the main thread can print next (caller holds the lock).
+ */
+static ParallelSlot* find_printable(ParallelPool* pool, size_t next_seq, int ordered) {
+    int i;
+    for (i = 0; i < pool->slot_count; i++) {
+        ParallelSlot* slot = &pool->slots[i];
+        if (slot->state == SLOT_DONE && (!ordered || slot->seq == next_seq)) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run a query against every record of a newline-delimited JSON file using
+ * several threads.
+ *
+ * @param query The parsed query
+ * @param filename Path of the input file, or "-" for standard input
+ * @param threads Number of worker threads
+ * @param ordered Nonzero to print results in input order
+ * @return 0 if every record succeeded, 1 otherwise
+ */
+int json_parallel_run(QueryNode* query, const char* filename, int threads, int ordered) {
+    JsonLineReader reader;
+    if (json_line_reader_open(&reader, filename) != 0) {
+        fprintf(stderr, "Error: Could not open file '%s'\n", filename);
+        return 1;
+    }
+
+    /* Pick the SIMD kernel once, before any worker can race to do it */
+    json_structural_kernel();
+
+    ParallelPool pool;
+    pool.program = compile_query(query);
+    pool.projection = json_projection_create(query);
+    pool.slot_count = threads * PARALLEL_SLOTS_PER_THREAD;
+    pool.slots = (ParallelSlot*)calloc((size_t)pool.slot_count, sizeof(ParallelSlot));
+    pool.shutdown = 0;
+    if (pool.slots == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_ready, NULL);
+    pthread_cond_init(&pool.work_done, NULL);
+
+    int i;
+    for (i = 0; i < pool.slot_count; i++) {
+        pool.slots[i].state = SLOT_FREE;
+        pool.slots[i].arena = json_arena_create(0);
+    }
+
+    pthread_t* workers = (pthread_t*)malloc((size_t)threads * sizeof(pthread_t));
+    if (workers == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, worker_main, &pool);
+    }
+
+    size_t submitted = 0;
+    size_t printed = 0;
+    int at_eof = 0;
+    int status = 0;
+
+    for (;;) {
+        /* Fill every free slot; only the main thread touches FREE slots,
+         * so the lines are copied in without holding the lock */
+        for (i = 0; i < pool.slot_count && !at_eof; i++) {
+            ParallelSlot* slot = &pool.slots[i];
+            pthread_mutex_lock(&pool.lock);
+            SlotState state = slot->state;
+            pthread_mutex_unlock(&pool.lock);
+            if (state != SLOT_FREE) continue;
+
+            const char* line;
+            size_t length;
+            slot->size = 0;
+            slot->record_count = 0;
+            slot->first_line = reader.line_number + 1;
+
+            while (slot->size < PARALLEL_CHUNK_SIZE) {
+                int read_status = json_line_reader_next(&reader, &line, &length);
+                if (read_status <= 0) {
+                    if (read_status < 0) {
+                        fprintf(stderr, "Error: Failed to read '%s'\n", filename);
+                        status = 1;
+                    }
+                    at_eof = 1;
+                    break;
+                }
+                slot_add_line(slot, line, length);
+            }
+
+            if (slot->size > 0) {
+                pthread_mutex_lock(&pool.lock);
+                slot->seq = submitted++;
+                slot->state = SLOT_QUEUED;
+                pthread_cond_signal(&pool.work_ready);
+                pthread_mutex_unlock(&pool.lock);
+            }
+        }
+
+        if (at_eof && printed == submitted) {
+            break;
+        }
+
+        /* Wait for the next chunk that may be printed */
+        pthread_mutex_lock(&pool.lock);
+        ParallelSlot* slot;
+        while ((slot = find_printable(&pool, printed, ordered)) == NULL) {
+            pthread_cond_wait(&pool.work_done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        if (print_slot(slot)) {
+            status = 1;
+        }
+        json_arena_reset(slot->arena);
+        printed++;
+
+        pthread_mutex_lock(&pool.lock);
+        slot->state = SLOT_FREE;
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    json_output_flush();
+
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    for (i = 0; i < pool.slot_count; i++) {
+        json_arena_destroy(pool.slots[i].arena);
+        free(pool.slots[i].data);
+        free(pool.slots[i].records);
+    }
+    free(pool.slots);
+    free_query_program(pool.program);
+    json_projection_free(pool.projection);
+    pthread_cond_destroy(&pool.work_done);
+    pthread_cond_destroy(&pool.work_ready);
+    pthread_mutex_destroy(&pool.lock);
+    json_line_reader_close(&reader);
+
+    return status;
+}
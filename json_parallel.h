@@ -0,0 +1,31 @@
+/**
+ * json_parallel.h
+ *
+ * Multi-threaded processing of newline-delimited JSON (jqlite --threads).
+ * The main thread reads the input in chunks of whole lines; worker threads
+ * parse and query each chunk into the chunk's own arena; the main thread
+ * prints the finished chunks, in input order unless unordered output was
+ * requested.
+ */
+
+#ifndef JSON_PARALLEL_H
+#define JSON_PARALLEL_H
+
+#include "json_value.h"
+
+/* Upper bound accepted for --threads */
+#define JSON_PARALLEL_MAX_THREADS 256
+
+/**
+ * Run a query against every record of a newline-delimited JSON file using
+ * several threads. Memory is bounded by a fixed number of in-flight chunks.
+ *
+ * @param query The parsed query (shared read-only by all workers)
+ * @param filename Path of the input file, or "-" for standard input
+ * @param threads Number of worker threads
+ * @param ordered Nonzero to print results in input order
+ * @return 0 if every record succeeded, 1 otherwise
+ */
+int json_parallel_run(QueryNode* query, const char* filename, int threads, int ordered);
+
+#endif /* JSON_PARALLEL_H */
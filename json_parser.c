@@ -0,0 +1,972 @@
+/**
+ * json_parser.c
+ *
+ * Stage 2 of the fast JSON parser: builds the JsonValue tree by walking
+ * the positions produced by the structural indexer. Structural characters
+ * are never searched for here; only string contents, numbers and literals
+ * are read byte by byte.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json_value.h"
+#include "json_structural.h"
+#include "json_parser.h"
+
+#if !defined(JSON_NO_SIMD) && defined(__SSE2__)
+#define JSON_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/**
+ * State of one parse.
+ */
+typedef struct JsonParser {
+    const char* data;                   // Input being parsed
+    size_t size;                        // Number of input bytes
+    JsonStructuralIndex index;          // Stage 1 index over the input
+    char* scratch;                      // Buffer for unescaped strings
+    size_t scratch_size;                // Allocated size of scratch
+    int failed;                         // Set once an error has been reported
+    int target_depth;                   // Depth of a fixed path's target, or -1
+    int done;                           // Set once that target has been parsed
+    int column_depth;                   // Depth of arrays that get a column, or -1
+    JsonKey* column_key;                // Field stored in that column
+} JsonParser;
+
+static JsonValue* parse_value(JsonParser* ps, size_t pos, int depth, const JsonProjectionStep* step);
+
+/**
+ * Report a parse error (only the first one is printed).
+ *
+ * @param ps The parser
+ * @param message Description of the problem
+ * @param pos Input offset where it was detected
+ */
+static void parse_error(JsonParser* ps, const char* message, size_t pos) {
+    if (ps->failed) return;
+    ps->failed = 1;
+
+    if (pos == JSON_STRUCTURAL_END || pos >= ps->size) {
+        fprintf(stderr, "JSON Parse Error: %s at end of input\n", message);
+    } else {
+        fprintf(stderr, "JSON Parse Error: %s at byte %lu\n", message, (unsigned long)pos);
+    }
+}
+
+/**
+ * Check whether a byte may directly follow a scalar.
+ */
+static int is_delimiter(char c) {
+    switch (c) {
+        case ' ': case '\t': case '\n': case '\r':
+        case ',': case ']': case '}': case ':':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Find the first '"' or '\\' in [p, end), or end if there is none.
+ * Scans 16 bytes at a time where SSE2 is available.
+ */
+static const char* find_quote_or_backslash(const char* p, const char* end) {
+#ifdef JSON_HAVE_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                                  _mm_cmpeq_epi8(v, bslash)));
+        if (mask != 0) {
+            return p + __builtin_ctz((unsigned)mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\') {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * Make sure the scratch buffer can hold `size` bytes.
+ */
+static void reserve_scratch(JsonParser* ps, size_t size) {
+    if (size <= ps->scratch_size) return;
+
+    size_t new_size = ps->scratch_size ? ps->scratch_size : 256;
+    while (new_size < size) {
+        new_size *= 2;
+    }
+    ps->scratch = (char*)realloc(ps->scratch, new_size);
+    if (ps->scratch == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    ps->scratch_size = new_size;
+}
+
+/**
+ * Parse four hex digits of a \u escape.
+ *
+ * @return The code unit, or -1 if the digits are invalid
+ */
+static long parse_hex4(const char* p, const char* end) {
+    long value = 0;
+    int i;
+
+    if (end - p < 4) return -1;
+    for (i = 0; i < 4; i++) {
+        char c = p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9')      value |= c - '0';
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else return -1;
+    }
+    return value;
+}
+
+/**
+ * Encode a code point as UTF-8.
+ *
+ * @return Number of bytes written
+ */
+static int encode_utf8(unsigned long cp, char* out) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+/**
+ * Decode the escape sequences of string text the parser has validated.
+ *
+ * @param text The raw text between the quotes
+ * @param length Its length
+ * @param out Receives the decoded text (at most `length` bytes)
+ * @return Length of the decoded text
+ */
+size_t json_unescape(const char* text, size_t length, char* out) {
+    const char* end = text + length;
+    size_t len = 0;
+
+    while (text < end) {
+        const char* backslash = (const char*)memchr(text, '\\', (size_t)(end - text));
+        size_t run = (size_t)((backslash ? backslash : end) - text);
+
+        memcpy(out + len, text, run);
+        len += run;
+        text += run;
+        if (backslash == NULL || text + 1 >= end) break;
+
+        switch (text[1]) {
+            case 'b':  out[len++] = '\b'; text += 2; break;
+            case 'f':  out[len++] = '\f'; text += 2; break;
+            case 'n':  out[len++] = '\n'; text += 2; break;
+            case 'r':  out[len++] = '\r'; text += 2; break;
+            case 't':  out[len++] = '\t'; text += 2; break;
+            case 'u': {
+                long cp = parse_hex4(text + 2, end);
+                text += 6;
+                if (cp >= 0xD800 && cp <= 0xDBFF && end - text >= 6 &&
+                    text[0] == '\\' && text[1] == 'u') {
+                    long low = parse_hex4(text + 2, end);
+                    if (low >= 0xDC00 && low <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        text += 6;
+                    }
+                }
+                if (cp >= 0) {
+                    len += (size_t)encode_utf8((unsigned long)cp, out + len);
+                }
+                break;
+            }
+            default:
+                /* \" \\ and \/ stand for the character itself */
+                out[len++] = text[1];
+                text += 2;
+                break;
+        }
+    }
+    return len;
+}
+
+/**
+ * Find the end of the string whose opening quote is at `pos`, checking
+ * its escape sequences without decoding them.
+ *
+ * @param ps The parser
+ * @param pos Offset of the opening quote
+ * @param out_len Receives the length of the raw text between the quotes
+ * @param out_escaped Receives 1 if the text contains escape sequences
+ * @return 1 on success, 0 on error
+ */
+static int scan_string(JsonParser* ps, size_t pos, size_t* out_len, int* out_escaped) {
+    const char* start = ps->data + pos + 1;
+    const char* end = ps->data + ps->size;
+    const char* p = find_quote_or_backslash(start, end);
+    int escaped = 0;
+
+    while (p < end && *p == '\\') {
+        escaped = 1;
+        if (p + 1 >= end) {
+            break;
+        }
+        switch (p[1]) {
+            case '"': case '\\': case '/': case 'b':
+            case 'f': case 'n': case 'r': case 't':
+                p += 2;
+                break;
+            case 'u':
+                if (parse_hex4(p + 2, end) < 0) {
+                    parse_error(ps, "invalid \\u escape", pos);
+                    return 0;
+                }
+                p += 6;
+                break;
+            default:
+                parse_error(ps, "invalid escape sequence", (size_t)(p - ps->data));
+                return 0;
+        }
+        p = find_quote_or_backslash(p, end);
+    }
+
+    if (p >= end) {
+        parse_error(ps, "unterminated string", pos);
+        return 0;
+    }
+
+    *out_len = (size_t)(p - start);
+    *out_escaped = escaped;
+    return 1;
+}
+
+/**
+ * Parse the string whose opening quote is at `pos`.
+ * Strings without escapes are returned in place; others are unescaped
+ * into the scratch buffer, which stays valid until the next string.
+ *
+ * @param ps The parser
+ * @param pos Offset of the opening quote
+ * @param out_str Receives a pointer to the string bytes
+ * @param out_len Receives the string length
+ * @return 1 on success, 0 on error
+ */
+static int parse_string(JsonParser* ps, size_t pos, const char** out_str, size_t* out_len) {
+    const char* start = ps->data + pos + 1;
+    const char* end = ps->data + ps->size;
+    const char* p = find_quote_or_backslash(start, end);
+    size_t length;
+    int escaped;
+
+    /* Fast path: no escapes, point straight into the input */
+    if (p < end && *p == '"') {
+        *out_str = start;
+        *out_len = (size_t)(p - start);
+        return 1;
+    }
+
+    /* Validate first, then decode; the text never grows when decoded */
+    if (!scan_string(ps, pos, &length, &escaped)) {
+        return 0;
+    }
+    reserve_scratch(ps, length);
+    *out_str = ps->scratch;
+    *out_len = json_unescape(start, length, ps->scratch);
+    return 1;
+}
+
+/**
+ * Parse the number starting at `pos`.
+ * The lexeme is validated against the JSON grammar before conversion.
+ *
+ * @param ps The parser
+ * @param pos Offset of the first character
+ * @return The number value, or NULL on error
+ */
+static JsonValue* parse_number(JsonParser* ps, size_t pos) {
+    const char* start = ps->data + pos;
+    const char* end = ps->data + ps->size;
+    const char* p = start;
+
+    if (p < end && *p == '-') p++;
+    if (p < end && *p == '0') {
+        p++;
+    } else if (p < end && *p >= '1' && *p <= '9') {
+        while (p < end && *p >= '0' && *p <= '9') p++;
+    } else {
+        parse_error(ps, "invalid number", pos);
+        return NULL;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        if (p >= end || *p < '0' || *p > '9') {
+            parse_error(ps, "invalid number", pos);
+            return NULL;
+        }
+        while (p < end && *p >= '0' && *p <= '9') p++;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) p++;
+        if (p >= end || *p < '0' || *p > '9') {
+            parse_error(ps, "invalid number", pos);
+            return NULL;
+        }
+        while (p < end && *p >= '0' && *p <= '9') p++;
+    }
+    if (p < end && !is_delimiter(*p)) {
+        parse_error(ps, "invalid number", pos);
+        return NULL;
+    }
+
+    return create_json_number_text(start, (size_t)(p - start));
+}
+
+/**
+ * Match a literal (true, false, null) at `pos`.
+ */
+static int match_literal(JsonParser* ps, size_t pos, const char* literal, size_t len) {
+    if (ps->size - pos < len || memcmp(ps->data + pos, literal, len) != 0) {
+        return 0;
+    }
+    return pos + len == ps->size || is_delimiter(ps->data[pos + len]);
+}
+
+/* Placeholder for array elements skipped by a projection. Flagged as an
+ * arena value so that free_json_value() never tries to release it. */
+static JsonValue skipped_element = { .type = JSON_NULL, .flags = JSON_FLAG_ARENA };
+
+/**
+ * Step that applies one level below `step`.
+ */
+static const JsonProjectionStep* step_below(const JsonProjectionStep* step) {
+    return step->kind == JSON_PROJECT_ALL ? step : step + 1;
+}
+
+/**
+ * Skip the value starting at `pos` without materializing it.
+ * Containers are only checked for correctly nested brackets.
+ *
+ * @return 1 on success, 0 on error
+ */
+static int skip_value(JsonParser* ps, size_t pos, int depth) {
+    uint64_t closers[(JSON_MAX_DEPTH + 64) / 64];   // 1 bit per level: set for '}'
+    int level = 0;
+
+    if (pos == JSON_STRUCTURAL_END) {
+        parse_error(ps, "unexpected end of input", pos);
+        return 0;
+    }
+
+    for (;;) {
+        char c = ps->data[pos];
+
+        if (c == '{' || c == '[') {
+            if (depth + level + 1 > JSON_MAX_DEPTH) {
+                parse_error(ps, "maximum nesting depth exceeded", pos);
+                return 0;
+            }
+            if (c == '{') closers[level / 64] |= (uint64_t)1 << (level % 64);
+            else closers[level / 64] &= ~((uint64_t)1 << (level % 64));
+            level++;
+        } else if (c == '}' || c == ']') {
+            if (level == 0) {
+                parse_error(ps, "unexpected character", pos);
+                return 0;
+            }
+            level--;
+            int want_brace = (int)((closers[level / 64] >> (level % 64)) & 1);
+            if (want_brace != (c == '}')) {
+                parse_error(ps, "mismatched bracket", pos);
+                return 0;
+            }
+        } else if (level == 0 && (c == ',' || c == ':')) {
+            parse_error(ps, "unexpected character", pos);
+            return 0;
+        }
+
+        if (level == 0) {
+            return 1;
+        }
+
+        pos = json_structural_next(&ps->index);
+        if (pos == JSON_STRUCTURAL_END) {
+            parse_error(ps, "unexpected end of input", pos);
+            return 0;
+        }
+    }
+}
+
+/**
+ * Parse an object; its '{' has just been consumed.
+ */
+static JsonValue* parse_object(JsonParser* ps, int depth, const JsonProjectionStep* step) {
+    JsonValue* object = create_json_object();
+
+    size_t next = json_structural_next(&ps->index);
+    if (next != JSON_STRUCTURAL_END && ps->data[next] == '}') {
+        return object;
+    }
+
+    for (;;) {
+        const char* key;
+        size_t key_len;
+
+        if (next == JSON_STRUCTURAL_END || ps->data[next] != '"') {
+            parse_error(ps, "expected string key in object", next);
+            return NULL;
+        }
+        if (!parse_string(ps, next, &key, &key_len)) {
+            return NULL;
+        }
+
+        next = json_structural_next(&ps->index);
+        if (next == JSON_STRUCTURAL_END || ps->data[next] != ':') {
+            parse_error(ps, "expected ':' after object key", next);
+            return NULL;
+        }
+
+        /* A filter field is parsed with the step meant for `field`; select()
+         * only looks at its type and number, which no projection changes */
+        int wanted = step->kind == JSON_PROJECT_ALL ||
+                     (step->kind == JSON_PROJECT_FIELD &&
+                      ((key_len == step->field_length &&
+                        memcmp(key, step->field, key_len) == 0) ||
+                       (step->filter_field != NULL && key_len == step->filter_field_length &&
+                        memcmp(key, step->filter_field, key_len) == 0)));
+
+        if (wanted) {
+            /* A decoded key sits in the scratch buffer, which parsing the
+             * value may reuse; keep it aside until the object has interned it */
+            char* decoded = NULL;
+            if (key == ps->scratch) {
+                decoded = (char*)malloc(key_len + 1);
+                if (decoded == NULL) {
+                    fprintf(stderr, "Error: Memory allocation failed\n");
+                    exit(1);
+                }
+                memcpy(decoded, key, key_len);
+                key = decoded;
+            }
+
+            JsonValue* value = parse_value(ps, json_structural_next(&ps->index), depth + 1,
+                                           step_below(step));
+            if (value != NULL) {
+                json_object_add_member(object, key, key_len, value);
+            }
+            free(decoded);
+            if (value == NULL) {
+                return NULL;
+            }
+            /* Early exit: the first occurrence of a duplicate key wins */
+            if (ps->done) {
+                return object;
+            }
+        } else if (!skip_value(ps, json_structural_next(&ps->index), depth + 1)) {
+            return NULL;
+        }
+
+        next = json_structural_next(&ps->index);
+        if (next != JSON_STRUCTURAL_END && ps->data[next] == ',') {
+            next = json_structural_next(&ps->index);
+            continue;
+        }
+        if (next != JSON_STRUCTURAL_END && ps->data[next] == '}') {
+            return object;
+        }
+        parse_error(ps, "expected ',' or '}' in object", next);
+        return NULL;
+    }
+}
+
+/**
+ * Allocate or grow a buffer owned by an array: in the arena for arena
+ * documents, on the heap otherwise.
+ */
+static void* array_buffer_resize(const JsonValue* array, void* buffer, size_t old_size,
+                                 size_t new_size) {
+    void* resized;
+    if (array->flags & JSON_FLAG_ARENA) {
+        resized = json_arena_realloc(json_arena_current(), buffer, old_size, new_size);
+    } else {
+        resized = realloc(buffer, new_size);
+    }
+    if (resized == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    return resized;
+}
+
+/**
+ * Attach an empty column for `key` to an array.
+ */
+static JsonColumn* column_create(JsonValue* array, const JsonKey* key) {
+    JsonColumn* column = (JsonColumn*)array_buffer_resize(array, NULL, 0, sizeof(JsonColumn));
+    column->key = key->atom;
+    column->types = NULL;
+    column->numbers = NULL;
+    column->length = 0;
+    column->capacity = 0;
+    column->next = array->value.array.columns;
+    array->value.array.columns = column;
+    return column;
+}
+
+/**
+ * Append the column field of a just-parsed element (still in cache).
+ */
+static void column_append(JsonValue* array, JsonColumn* column, JsonKey* key,
+                          JsonValue* element) {
+    if (column->length == column->capacity) {
+        size_t capacity = column->capacity ? column->capacity * 2 : 16;
+        column->types = (unsigned char*)array_buffer_resize(array, column->types,
+                                                            column->capacity, capacity);
+        column->numbers = (double*)array_buffer_resize(array, column->numbers,
+                                                       column->capacity * sizeof(double),
+                                                       capacity * sizeof(double));
+        column->capacity = capacity;
+    }
+
+    /* Shaped records make this an indexed load via the key's inline cache */
+    JsonValue* value = element->type == JSON_OBJECT ? json_object_get_key(element, key) : NULL;
+    size_t row = column->length++;
+    if (value == NULL) {
+        column->types[row] = JSON_COLUMN_MISSING;
+        column->numbers[row] = 0;
+    } else {
+        column->types[row] = (unsigned char)value->type;
+        column->numbers[row] = value->type == JSON_NUMBER ? json_number_value(value) : 0;
+    }
+}
+
+/**
+ * Parse an array; its '[' has just been consumed.
+ */
+static JsonValue* parse_array(JsonParser* ps, int depth, const JsonProjectionStep* step) {
+    JsonValue* array = create_json_array();
+    JsonColumn* column = NULL;
+    size_t start = 0;
+    size_t end = JSON_PROJECT_NO_END;
+    size_t k;
+
+    if (step->kind == JSON_PROJECT_RANGE) {
+        start = step->start;
+        end = step->end;
+    } else if (step->kind == JSON_PROJECT_FIELD) {
+        /* A field of an array is an error whatever the elements are */
+        end = 0;
+    }
+
+    size_t next = json_structural_peek(&ps->index);
+    if (next != JSON_STRUCTURAL_END && ps->data[next] == ']') {
+        json_structural_next(&ps->index);
+        return array;
+    }
+
+    if (depth == ps->column_depth) {
+        column = column_create(array, ps->column_key);
+    }
+
+    for (k = 0; ; k++) {
+        size_t pos = json_structural_next(&ps->index);
+
+        if (k >= start && k < end) {
+            JsonValue* element = parse_value(ps, pos, depth + 1, step_below(step));
+            if (element == NULL) {
+                return NULL;
+            }
+            json_array_add(array, element);
+            if (column != NULL) {
+                column_append(array, column, ps->column_key, element);
+            }
+            if (ps->done) {
+                return array;
+            }
+        } else {
+            if (!skip_value(ps, pos, depth + 1)) {
+                return NULL;
+            }
+            /* Elements after the range are dropped; earlier ones hold their index */
+            if (k < start && step->kind == JSON_PROJECT_RANGE) {
+                json_array_add(array, &skipped_element);
+            }
+        }
+
+        next = json_structural_next(&ps->index);
+        if (next != JSON_STRUCTURAL_END && ps->data[next] == ',') {
+            continue;
+        }
+        if (next != JSON_STRUCTURAL_END && ps->data[next] == ']') {
+            return array;
+        }
+        parse_error(ps, "expected ',' or ']' in array", next);
+        return NULL;
+    }
+}
+
+static JsonValue* parse_value_at(JsonParser* ps, size_t pos, int depth, const JsonProjectionStep* step);
+
+/**
+ * Parse the value starting at structural position `pos`.
+ *
+ * @param ps The parser
+ * @param pos Offset of the value's first byte
+ * @param depth Current nesting depth
+ * @param step Projection step for this value
+ * @return The value, or NULL on error
+ */
+static JsonValue* parse_value(JsonParser* ps, size_t pos, int depth, const JsonProjectionStep* step) {
+    JsonValue* value = parse_value_at(ps, pos, depth, step);
+
+    /* Only the target of a fixed path is parsed at its depth */
+    if (depth == ps->target_depth && value != NULL) {
+        ps->done = 1;
+    }
+    return value;
+}
+
+/**
+ * Parse the value starting at `pos` (see parse_value).
+ */
+static JsonValue* parse_value_at(JsonParser* ps, size_t pos, int depth, const JsonProjectionStep* step) {
+    if (pos == JSON_STRUCTURAL_END) {
+        parse_error(ps, "unexpected end of input", pos);
+        return NULL;
+    }
+    if (depth > JSON_MAX_DEPTH) {
+        parse_error(ps, "maximum nesting depth exceeded", pos);
+        return NULL;
+    }
+
+    switch (ps->data[pos]) {
+        case '{':
+            return parse_object(ps, depth, step);
+
+        case '[':
+            return parse_array(ps, depth, step);
+
+        case '"': {
+            /* Kept as a span of the input; escapes are left for the printer */
+            size_t len;
+            int escaped;
+            if (!scan_string(ps, pos, &len, &escaped)) {
+                return NULL;
+            }
+            return create_json_string_span(ps->data + pos + 1, len, escaped);
+        }
+
+        case 't':
+            if (match_literal(ps, pos, "true", 4)) return create_json_bool(1);
+            break;
+
+        case 'f':
+            if (match_literal(ps, pos, "false", 5)) return create_json_bool(0);
+            break;
+
+        case 'n':
+            if (match_literal(ps, pos, "null", 4)) return create_json_null();
+            break;
+
+        case '-': case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            return parse_number(ps, pos);
+
+        default:
+            parse_error(ps, "unexpected character", pos);
+            return NULL;
+    }
+
+    parse_error(ps, "invalid literal", pos);
+    return NULL;
+}
+
+/**
+ * Append a step to a projection being built.
+ */
+static JsonProjectionStep* projection_add(JsonProjection* projection, JsonProjectionKind kind) {
+    JsonProjectionStep* steps = (JsonProjectionStep*)realloc(projection->steps,
+                                    (projection->count + 1) * sizeof(JsonProjectionStep));
+    if (steps == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    projection->steps = steps;
+
+    JsonProjectionStep* step = &steps[projection->count++];
+    step->kind = kind;
+    step->field = NULL;
+    step->field_length = 0;
+    step->start = 0;
+    step->end = JSON_PROJECT_NO_END;
+    step->filter_field = NULL;
+    step->filter_field_length = 0;
+    return step;
+}
+
+/**
+ * Add the steps of a query chain to a projection.
+ * Operations that produce a new array at the same level (slice, iteration
+ * with a chained operation) end the path, because what follows them no
+ * longer maps onto one level of the document. After a select() the
+ * array's positions no longer match the document's, but its elements do:
+ * slices are passed over and indexes keep every element, projected for
+ * what follows.
+ *
+ * @return 1 if later operations may still extend the path, 0 if it has ended
+ */
+static int projection_add_query(JsonProjection* projection, QueryNode* query) {
+    QueryNode* node;
+
+    for (node = query; node != NULL; node = node->next) {
+        /* Still at the array a select() filtered */
+        int filtered = projection->column_key != NULL &&
+                       projection->count == projection->column_depth;
+
+        switch (node->type) {
+            case QUERY_IDENTITY:
+                break;
+
+            case QUERY_FIELD: {
+                if (filtered) return 0;
+                JsonProjectionStep* step = projection_add(projection, JSON_PROJECT_FIELD);
+                step->field = node->data.field.name;
+                step->field_length = node->data.field.length;
+                break;
+            }
+
+            case QUERY_INDEX: {
+                if (node->data.index < 0) {
+                    projection->fixed_path = 0;
+                    return 0;
+                }
+                if (filtered) {
+                    projection_add(projection, JSON_PROJECT_RANGE);
+                    break;
+                }
+                JsonProjectionStep* step = projection_add(projection, JSON_PROJECT_RANGE);
+                step->start = (size_t)node->data.index;
+                step->end = (size_t)node->data.index + 1;
+                break;
+            }
+
+            case QUERY_FOLDED_INDEX: {
+                /* Folded only from a non-negative index into the slice */
+                if (filtered) {
+                    projection_add(projection, JSON_PROJECT_RANGE);
+                    break;
+                }
+                JsonProjectionStep* step = projection_add(projection, JSON_PROJECT_RANGE);
+                step->start = (size_t)node->data.folded.position;
+                step->end = (size_t)node->data.folded.position + 1;
+                break;
+            }
+
+            case QUERY_SLICE: {
+                projection->fixed_path = 0;
+                if (filtered) break;
+                int start = node->data.slice.start;
+                int end = node->data.slice.end;
+                if (end < -1 || (end >= 0 && end <= start)) return 0;
+                JsonProjectionStep* step = projection_add(projection, JSON_PROJECT_RANGE);
+                step->start = start > 0 ? (size_t)start : 0;
+                step->end = end == -1 ? JSON_PROJECT_NO_END : (size_t)end;
+                return 0;
+            }
+
+            case QUERY_ARRAY_ITER:
+                /* Without a chained operation the array passes through as is */
+                projection->fixed_path = 0;
+                if (node->next == NULL) break;
+                projection_add(projection, JSON_PROJECT_RANGE);
+                projection_add_query(projection, node->next);
+                return 0;
+
+            case QUERY_PIPE:
+                if (!projection_add_query(projection, node->data.pipe.left)) return 0;
+                if (!projection_add_query(projection, node->data.pipe.right)) return 0;
+                break;
+
+            case QUERY_SELECT: {
+                /* select(.field op n) over the value at the end of the path:
+                 * arrays there keep the field as a column for the filter */
+                QueryNode* left = node->data.condition->left;
+                projection->fixed_path = 0;
+                if (projection->column_key != NULL || left == NULL ||
+                    left->type != QUERY_FIELD || left->next != NULL) {
+                    return 0;
+                }
+                projection->column_key = &left->data.field;
+                projection->column_depth = projection->count;
+                break;
+            }
+
+            default:
+                projection->fixed_path = 0;
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Derive the projection of a query.
+ *
+ * @param query The parsed query
+ * @return The projection
+ */
+JsonProjection* json_projection_create(QueryNode* query) {
+    JsonProjection* projection = (JsonProjection*)malloc(sizeof(JsonProjection));
+    if (projection == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    projection->steps = NULL;
+    projection->count = 0;
+    projection->fixed_path = 1;
+    projection->column_key = NULL;
+    projection->column_depth = 0;
+
+    projection_add_query(projection, query);
+
+    /* Elements of a filtered array also keep the field select() tests.
+     * Elements the rest of the query indexes as arrays are kept whole. */
+    if (projection->column_key != NULL && projection->count > projection->column_depth + 1) {
+        JsonProjectionStep* element = &projection->steps[projection->column_depth + 1];
+        if (element->kind == JSON_PROJECT_FIELD) {
+            element->filter_field = projection->column_key->name;
+            element->filter_field_length = projection->column_key->length;
+        } else {
+            projection->count = projection->column_depth + 1;
+        }
+    }
+
+    projection_add(projection, JSON_PROJECT_ALL);
+    return projection;
+}
+
+/**
+ * Print a projection on one line: a step per level, `*` for the values
+ * kept whole, then the filter column if there is one.
+ *
+ * @param projection The projection
+ * @param out Where to print
+ */
+void json_projection_print(const JsonProjection* projection, FILE* out) {
+    size_t i;
+
+    fputs("Projection:", out);
+    for (i = 0; i < projection->count; i++) {
+        const JsonProjectionStep* step = &projection->steps[i];
+        switch (step->kind) {
+            case JSON_PROJECT_ALL:
+                fputs(" *", out);
+                break;
+            case JSON_PROJECT_FIELD:
+                fprintf(out, " .%.*s", (int)step->field_length, step->field);
+                if (step->filter_field != NULL) {
+                    fprintf(out, "+.%.*s", (int)step->filter_field_length, step->filter_field);
+                }
+                break;
+            case JSON_PROJECT_RANGE:
+                if (step->end == JSON_PROJECT_NO_END) {
+                    fprintf(out, " [%lu:]", (unsigned long)step->start);
+                } else {
+                    fprintf(out, " [%lu:%lu]", (unsigned long)step->start,
+                            (unsigned long)step->end);
+                }
+                break;
+        }
+    }
+    if (projection->column_key != NULL) {
+        fprintf(out, ", column .%s at depth %lu", projection->column_key->name,
+                (unsigned long)projection->column_depth);
+    }
+    if (projection->fixed_path) {
+        fputs(", fixed path", out);
+    }
+    fputc('\n', out);
+}
+
+/**
+ * Free a projection.
+ *
+ * @param projection The projection to free
+ */
+void json_projection_free(JsonProjection* projection) {
+    if (projection == NULL) return;
+    free(projection->steps);
+    free(projection);
+}
+
+/**
+ * Parse a document, materializing only the values inside a projection.
+ *
+ * @param data The JSON text
+ * @param size Number of bytes of JSON text
+ * @param projection The projection, or NULL to materialize everything
+ * @return The root value, or NULL on error
+ */
+JsonValue* json_parse_projected(const char* data, size_t size, const JsonProjection* projection) {
+    static const JsonProjectionStep everything = { JSON_PROJECT_ALL, NULL, 0, 0, JSON_PROJECT_NO_END,
+                                                   NULL, 0 };
+    JsonParser ps;
+    ps.data = data;
+    ps.size = size;
+    ps.scratch = NULL;
+    ps.scratch_size = 0;
+    ps.failed = 0;
+    ps.done = 0;
+    ps.target_depth = -1;
+    ps.column_depth = -1;
+    ps.column_key = NULL;
+    json_structural_init(&ps.index, data, size);
+
+    /* A fixed path below the root can stop at its target (the root itself
+     * is parsed completely anyway, so trailing content is still checked) */
+    if (projection != NULL && projection->fixed_path && projection->count > 1) {
+        ps.target_depth = (int)projection->count - 1;
+    }
+    if (projection != NULL && projection->column_key != NULL) {
+        ps.column_depth = (int)projection->column_depth;
+        ps.column_key = projection->column_key;
+    }
+
+    const JsonProjectionStep* step = projection != NULL ? projection->steps : &everything;
+    JsonValue* root = parse_value(&ps, json_structural_next(&ps.index), 0, step);
+    if (root != NULL && !ps.done) {
+        size_t trailing = json_structural_next(&ps.index);
+        if (trailing != JSON_STRUCTURAL_END) {
+            parse_error(&ps, "unexpected content after JSON value", trailing);
+            root = NULL;
+        }
+    }
+
+    json_structural_free(&ps.index);
+    free(ps.scratch);
+    return root;
+}
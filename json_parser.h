@@ -0,0 +1,117 @@
+/**
+ * json_parser.h
+ *
+ * Hand-written JSON parser built on the SIMD structural indexer
+ * (json_structural.h). This is the default parser; the flex/Bison grammar
+ * in json.l/json.y remains available for comparison (jqlite --flex).
+ */
+
+#ifndef JSON_PARSER_H
+#define JSON_PARSER_H
+
+#include <stddef.h>
+#include "json_value.h"
+
+/* Maximum nesting depth of arrays and objects */
+#define JSON_MAX_DEPTH 10000
+
+/**
+ * Kinds of projection step.
+ */
+typedef enum {
+    JSON_PROJECT_ALL,       // Keep the whole value (always the last step)
+    JSON_PROJECT_FIELD,     // Keep only members named `field`
+    JSON_PROJECT_RANGE      // Keep only array elements in [start, end)
+} JsonProjectionKind;
+
+/**
+ * One level of a projection. Step i applies to values at nesting depth i
+ * below the root; skipped members are dropped, skipped elements before
+ * `start` are kept as placeholders so that indexes stay valid.
+ */
+typedef struct JsonProjectionStep {
+    JsonProjectionKind kind;
+    const char* field;                  // For JSON_PROJECT_FIELD (borrowed from the query)
+    size_t field_length;
+    size_t start;                       // For JSON_PROJECT_RANGE
+    size_t end;                         // Exclusive; JSON_PROJECT_NO_END for "to the end"
+    const char* filter_field;           // Field kept besides `field`: the one select() tests
+    size_t filter_field_length;
+} JsonProjectionStep;
+
+#define JSON_PROJECT_NO_END ((size_t)-1)
+
+/**
+ * The parts of a document a query can reach, derived from its QueryNode
+ * chain. Values outside the projection are validated structurally but
+ * never materialized.
+ *
+ * If the path reaches a select() on a field, arrays at that depth also
+ * get a JsonColumn for that field, filled while their elements are
+ * parsed. The path goes on below the filter when what follows it reads
+ * the elements: they are projected for it and keep the tested field.
+ */
+typedef struct JsonProjection {
+    JsonProjectionStep* steps;          // Ends with a JSON_PROJECT_ALL step
+    size_t count;                       // Number of steps, including the last
+    int fixed_path;                     // 1 if the query is only fields and indexes
+    JsonKey* column_key;                // Field to store as a column, or NULL
+    size_t column_depth;                // Depth of the arrays that get the column
+} JsonProjection;
+
+/**
+ * Derive the projection of a query. The result borrows field names (and
+ * the filtered field's JsonKey, whose inline cache it uses) from the
+ * query, which must outlive it.
+ *
+ * @param query The parsed query
+ * @return The projection (free with json_projection_free)
+ */
+JsonProjection* json_projection_create(QueryNode* query);
+
+/**
+ * Print a projection on one line, for --explain.
+ */
+void json_projection_print(const JsonProjection* projection, FILE* out);
+
+/**
+ * Free a projection created by json_projection_create().
+ */
+void json_projection_free(JsonProjection* projection);
+
+/**
+ * Decode the escape sequences of validated JSON string text, such as the
+ * span of a string with JSON_FLAG_ESCAPED. Decoding never makes the text
+ * longer.
+ *
+ * @param text The raw text between the quotes
+ * @param length Its length
+ * @param out Receives the decoded text (room for `length` bytes)
+ * @return Length of the decoded text
+ */
+size_t json_unescape(const char* text, size_t length, char* out);
+
+/**
+ * Parse a JSON document from a buffer, materializing only the values
+ * inside a projection (all of them when there is none).
+ * Everything else is checked for balanced brackets and skipped without
+ * allocating, so the resulting tree is only meaningful to the query the
+ * projection was derived from. Values are created with create_json_*, so
+ * they come from the current arena if one is set. The buffer does not
+ * need to be NUL-terminated.
+ *
+ * For a fixed path (only fields and indexes) parsing stops as soon as the
+ * target value is complete: the rest of the input is neither read nor
+ * validated, and the returned tree is just the path down to the target.
+ * A key that repeats in an object on the path therefore resolves to its
+ * first occurrence, where a full parse (and --flex) keeps the last one;
+ * inputs without duplicate keys give the same result either way.
+ *
+ * @param data The JSON text
+ * @param size Number of bytes of JSON text
+ * @param projection The projection, or NULL to materialize everything
+ * @return The root value, or NULL on error (a message is printed to stderr)
+ */
+JsonValue* json_parse_projected(const char* data, size_t size, const JsonProjection* projection);
+
+#endif /* JSON_PARSER_H */
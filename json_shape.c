@@ -0,0 +1,171 @@
+/**
+ * json_shape.c
+ *
+ * Implementation of the shape transition table.
+ * Transitions are stored in an open-addressing array keyed by
+ * (parent shape, key atom), kept at most half full. Each thread caches the
+ * transitions it used last in a direct-mapped array, so parsing records
+ * that repeat a schema only reads thread-local memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "json_shape.h"
+
+#ifdef _MSC_VER
+#define SHAPE_THREAD_LOCAL __declspec(thread)
+#else
+#define SHAPE_THREAD_LOCAL __thread
+#endif
+
+#define SHAPE_CACHE_SIZE 512            // Per-thread cache entries (a power of two)
+#define SHAPE_INITIAL_CAPACITY 1024     // First table size (a power of two)
+
+/**
+ * One edge of the transition tree.
+ */
+typedef struct ShapeTransition {
+    uint32_t parent;                    // Shape before adding the key
+    uint32_t child;                     // Shape after adding it (0 = empty slot)
+    const char* key;                    // The key's atom
+} ShapeTransition;
+
+static pthread_mutex_t shape_lock = PTHREAD_MUTEX_INITIALIZER;
+static ShapeTransition* shape_table = NULL;
+static size_t shape_capacity = 0;
+static uint32_t shape_count = 1;        // JSON_SHAPE_EMPTY exists from the start
+
+static SHAPE_THREAD_LOCAL ShapeTransition shape_cache[SHAPE_CACHE_SIZE];
+
+int json_shape_stats_enabled = 0;
+static atomic_uint_least64_t stat_hits;
+static atomic_uint_least64_t stat_misses;
+
+/**
+ * Hash a (shape, atom) pair. Atoms are unique, so their address is hashed.
+ */
+static uint32_t transition_hash(uint32_t parent, const char* atom) {
+    uint64_t x = (uint64_t)(uintptr_t)atom ^ ((uint64_t)parent << 32);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (uint32_t)x;
+}
+
+/**
+ * Put a transition into the first free slot of its probe sequence
+ * (caller holds the lock).
+ */
+static void table_insert(const ShapeTransition* transition) {
+    size_t mask = shape_capacity - 1;
+    size_t slot = transition_hash(transition->parent, transition->key) & mask;
+    while (shape_table[slot].child != 0) {
+        slot = (slot + 1) & mask;
+    }
+    shape_table[slot] = *transition;
+}
+
+/**
+ * Double the table and rehash every transition (caller holds the lock).
+ */
+static void table_grow(void) {
+    ShapeTransition* old_table = shape_table;
+    size_t old_capacity = shape_capacity;
+    size_t i;
+
+    shape_capacity = old_capacity ? old_capacity * 2 : SHAPE_INITIAL_CAPACITY;
+    shape_table = (ShapeTransition*)calloc(shape_capacity, sizeof(ShapeTransition));
+    if (shape_table == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+
+    for (i = 0; i < old_capacity; i++) {
+        if (old_table[i].child != 0) {
+            table_insert(&old_table[i]);
+        }
+    }
+    free(old_table);
+}
+
+/**
+ * Get the shape reached by adding an interned key to an object.
+ *
+ * @param shape The object's current shape
+ * @param atom The new key's atom
+ * @return The new shape, or JSON_SHAPE_NONE if the table is full
+ */
+uint32_t json_shape_transition(uint32_t shape, const char* atom) {
+    uint32_t hash = transition_hash(shape, atom);
+    ShapeTransition* cached = &shape_cache[hash & (SHAPE_CACHE_SIZE - 1)];
+    uint32_t child = JSON_SHAPE_NONE;
+
+    if (cached->child != 0 && cached->parent == shape && cached->key == atom) {
+        return cached->child;
+    }
+
+    pthread_mutex_lock(&shape_lock);
+    if (shape_capacity > 0) {
+        size_t mask = shape_capacity - 1;
+        size_t slot = hash & mask;
+        while (shape_table[slot].child != 0) {
+            if (shape_table[slot].parent == shape && shape_table[slot].key == atom) {
+                child = shape_table[slot].child;
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+    if (child == JSON_SHAPE_NONE && shape_count < JSON_SHAPE_MAX_COUNT) {
+        ShapeTransition transition;
+
+        if ((size_t)shape_count * 2 > shape_capacity) {
+            table_grow();
+        }
+        transition.parent = shape;
+        transition.child = ++shape_count;
+        transition.key = atom;
+        table_insert(&transition);
+        child = transition.child;
+    }
+    pthread_mutex_unlock(&shape_lock);
+
+    if (child != JSON_SHAPE_NONE) {
+        cached->parent = shape;
+        cached->child = child;
+        cached->key = atom;
+    }
+    return child;
+}
+
+/**
+ * Start counting inline cache hits and misses.
+ */
+void json_shape_enable_stats(void) {
+    json_shape_stats_enabled = 1;
+}
+
+/**
+ * Record the outcome of one inline cache lookup.
+ *
+ * @param hit Nonzero if the cache served the lookup
+ */
+void json_shape_count_lookup(int hit) {
+    atomic_fetch_add_explicit(hit ? &stat_hits : &stat_misses, 1, memory_order_relaxed);
+}
+
+/**
+ * Read the counters.
+ *
+ * @param stats Receives the current values
+ */
+void json_shape_get_stats(JsonShapeStats* stats) {
+    stats->cache_hits = atomic_load_explicit(&stat_hits, memory_order_relaxed);
+    stats->cache_misses = atomic_load_explicit(&stat_misses, memory_order_relaxed);
+
+    pthread_mutex_lock(&shape_lock);
+    stats->shapes = shape_count;
+    pthread_mutex_unlock(&shape_lock);
+}
@@ -0,0 +1,71 @@
+/**
+ * json_shape.h
+ *
+ * Shapes ("hidden classes") of JSON objects.
+ * Two objects have the same shape exactly when their interned keys were
+ * added in the same order, so a key found at member position N of one
+ * object is at position N of every object of that shape. Shapes are plain
+ * numbers handed out by a process-wide transition table
+ * (shape, key) -> shape, shared by all documents and threads; like the
+ * atom table it sits behind a mutex with a lock-free per-thread cache in
+ * front of it.
+ *
+ * Query field lookups use shapes as inline caches (see JsonKey): after one
+ * lookup, the next object of the same shape is served by an indexed load.
+ */
+
+#ifndef JSON_SHAPE_H
+#define JSON_SHAPE_H
+
+#include <stdint.h>
+
+#define JSON_SHAPE_NONE 0               // Object is not tracked (lookups always search)
+#define JSON_SHAPE_EMPTY 1              // Shape of every object with no members
+
+/* Objects with more members than this are not tracked: they are usually
+ * maps rather than records, and would only fill the table */
+#define JSON_SHAPE_MAX_MEMBERS 64
+
+/* Upper bound on the number of shapes */
+#define JSON_SHAPE_MAX_COUNT (1 << 20)
+
+/**
+ * Get the shape reached by adding an interned key to an object.
+ *
+ * @param shape The object's current shape (not JSON_SHAPE_NONE)
+ * @param atom The new key, as returned by json_atom_intern()
+ * @return The new shape, or JSON_SHAPE_NONE if the table is full
+ */
+uint32_t json_shape_transition(uint32_t shape, const char* atom);
+
+/**
+ * Counters for --stats.
+ */
+typedef struct JsonShapeStats {
+    uint64_t cache_hits;                // Field lookups served by an inline cache
+    uint64_t cache_misses;              // Field lookups that searched the object
+    uint64_t shapes;                    // Distinct shapes created so far
+} JsonShapeStats;
+
+/**
+ * Start counting inline cache hits and misses. Off by default, since the
+ * shared counters cost an atomic add per lookup.
+ */
+void json_shape_enable_stats(void);
+
+/**
+ * Nonzero if json_shape_enable_stats() has been called.
+ */
+extern int json_shape_stats_enabled;
+
+/**
+ * Record the outcome of one inline cache lookup (when stats are enabled).
+ */
+void json_shape_count_lookup(int hit);
+
+/**
+ * Read the counters.
+ */
+void json_shape_get_stats(JsonShapeStats* stats);
+
+#endif /* JSON_SHAPE_H */
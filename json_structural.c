@@ -0,0 +1,352 @@
+/**
+ * json_structural.c
+ *
+ * Implementation of the stage 1 structural indexer.
+ *
+ * Each 64-byte block is first classified into four bitmasks (backslashes,
+ * quotes, whitespace, operators) by an AVX2, SSE2 or scalar kernel. The
+ * rest is plain 64-bit arithmetic shared by all kernels:
+ *   1. characters escaped by an odd run of backslashes are found with the
+ *      carry trick from simdjson, and escaped quotes are dropped;
+ *   2. a prefix XOR over the remaining quotes marks every byte inside a
+ *      string, so operators in strings are ignored;
+ *   3. scalars are located as runs of bytes that are neither whitespace,
+ *      operators nor string bytes, and the first byte of each run is kept.
+ * State that spans blocks (open string, pending escape, open scalar) is
+ * carried in the index.
+ *
+ * Build with -DJSON_NO_SIMD to force the scalar kernel, or -DJSON_NO_AVX2
+ * to stop at SSE2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json_structural.h"
+
+#if !defined(JSON_NO_SIMD) && defined(__SSE2__)
+#define JSON_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if !defined(JSON_NO_SIMD) && !defined(JSON_NO_AVX2) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define JSON_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+/**
+ * Classification of one 64-byte block, one bit per byte.
+ */
+typedef struct BlockMasks {
+    uint64_t backslash;                 // '\\'
+    uint64_t quote;                     // '"'
+    uint64_t whitespace;                // ' ', '\t', '\n', '\r'
+    uint64_t op;                        // '{', '}', '[', ']', ':', ','
+} BlockMasks;
+
+typedef void (*ClassifyFn)(const char* block, BlockMasks* masks);
+
+/* Kernel selected for this CPU */
+static ClassifyFn classify_block = NULL;
+static const char* classify_name = "scalar";
+
+#ifndef JSON_HAVE_SSE2
+/* Character classes used by the scalar kernel */
+#define CLASS_WS     1
+#define CLASS_OP     2
+#define CLASS_QUOTE  4
+#define CLASS_BSLASH 8
+
+static const unsigned char char_class[256] = {
+    [' '] = CLASS_WS, ['\t'] = CLASS_WS, ['\n'] = CLASS_WS, ['\r'] = CLASS_WS,
+    ['{'] = CLASS_OP, ['}'] = CLASS_OP, ['['] = CLASS_OP, [']'] = CLASS_OP,
+    [':'] = CLASS_OP, [','] = CLASS_OP,
+    ['"'] = CLASS_QUOTE, ['\\'] = CLASS_BSLASH
+};
+
+/**
+ * Scalar kernel: one table lookup per byte.
+ */
+static void classify_scalar(const char* block, BlockMasks* masks) {
+    uint64_t bs = 0, quote = 0, ws = 0, op = 0;
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        unsigned char c = char_class[(unsigned char)block[i]];
+        uint64_t bit = (uint64_t)1 << i;
+        if (c & CLASS_WS)     ws |= bit;
+        if (c & CLASS_OP)     op |= bit;
+        if (c & CLASS_QUOTE)  quote |= bit;
+        if (c & CLASS_BSLASH) bs |= bit;
+    }
+    masks->backslash = bs;
+    masks->quote = quote;
+    masks->whitespace = ws;
+    masks->op = op;
+}
+#endif
+
+#ifdef JSON_HAVE_SSE2
+/**
+ * SSE2 kernel: four 16-byte lanes per block.
+ * Brackets and braces differ from each other only in bit 0x20, so
+ * OR-ing that bit in lets one compare match both '[' and '{' (and ']'/'}').
+ */
+static void classify_sse2(const char* block, BlockMasks* masks) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i open_brace = _mm_set1_epi8('{');
+    const __m128i close_brace = _mm_set1_epi8('}');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i comma = _mm_set1_epi8(',');
+    uint64_t bs = 0, qt = 0, ws = 0, op = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(block + 16 * i));
+        __m128i folded = _mm_or_si128(v, case_bit);
+        __m128i w = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, cr)));
+        __m128i o = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(folded, open_brace),
+                                              _mm_cmpeq_epi8(folded, close_brace)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma)));
+        int shift = 16 * i;
+        bs |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, bslash)) << shift;
+        qt |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << shift;
+        ws |= (uint64_t)(uint16_t)_mm_movemask_epi8(w) << shift;
+        op |= (uint64_t)(uint16_t)_mm_movemask_epi8(o) << shift;
+    }
+    masks->backslash = bs;
+    masks->quote = qt;
+    masks->whitespace = ws;
+    masks->op = op;
+}
+#endif
+
+#ifdef JSON_HAVE_AVX2
+/**
+ * AVX2 kernel: two 32-byte lanes per block. Compiled for AVX2 regardless
+ * of the global target and only used when the CPU reports support.
+ */
+__attribute__((target("avx2")))
+static void classify_avx2(const char* block, BlockMasks* masks) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i open_brace = _mm256_set1_epi8('{');
+    const __m256i close_brace = _mm256_set1_epi8('}');
+    const __m256i colon = _mm256_set1_epi8(':');
+    const __m256i comma = _mm256_set1_epi8(',');
+    uint64_t bs = 0, qt = 0, ws = 0, op = 0;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(block + 32 * i));
+        __m256i folded = _mm256_or_si256(v, case_bit);
+        __m256i w = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                                     _mm256_cmpeq_epi8(v, tab)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, newline),
+                                                    _mm256_cmpeq_epi8(v, cr)));
+        __m256i o = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(folded, open_brace),
+                                                     _mm256_cmpeq_epi8(folded, close_brace)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, colon),
+                                                    _mm256_cmpeq_epi8(v, comma)));
+        int shift = 32 * i;
+        bs |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, bslash)) << shift;
+        qt |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quote)) << shift;
+        ws |= (uint64_t)(uint32_t)_mm256_movemask_epi8(w) << shift;
+        op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(o) << shift;
+    }
+    masks->backslash = bs;
+    masks->quote = qt;
+    masks->whitespace = ws;
+    masks->op = op;
+}
+#endif
+
+/**
+ * Pick the widest kernel the CPU supports.
+ */
+static void select_kernel(void) {
+    if (classify_block != NULL) return;
+
+#ifdef JSON_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        classify_name = "avx2";
+        classify_block = classify_avx2;
+        return;
+    }
+#endif
+#ifdef JSON_HAVE_SSE2
+    classify_name = "sse2";
+    classify_block = classify_sse2;
+#else
+    classify_name = "scalar";
+    classify_block = classify_scalar;
+#endif
+}
+
+/**
+ * Name of the kernel selected for this CPU.
+ */
+const char* json_structural_kernel(void) {
+    select_kernel();
+    return classify_name;
+}
+
+/**
+ * Find the characters escaped by an odd-length run of backslashes.
+ * Adding the run starts to the backslash mask makes the carry ripple to
+ * the first byte after each run; the parity of where the run started and
+ * where the carry lands tells whether the run was odd.
+ *
+ * @param backslash Backslash mask of the block
+ * @param prev_escaped In/out: 1 if the first byte of the block is escaped
+ * @return Mask of escaped characters
+ */
+static uint64_t find_escaped(uint64_t backslash, uint64_t* prev_escaped) {
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    const uint64_t odd_bits = ~even_bits;
+    uint64_t start_edges = backslash & ~(backslash << 1);
+    uint64_t even_start_mask = even_bits ^ *prev_escaped;
+    uint64_t even_starts = start_edges & even_start_mask;
+    uint64_t odd_starts = start_edges & ~even_start_mask;
+    uint64_t even_carries = backslash + even_starts;
+    uint64_t odd_carries = backslash + odd_starts;
+    uint64_t ends_odd = odd_carries < backslash;
+
+    odd_carries |= *prev_escaped;
+    *prev_escaped = ends_odd;
+
+    uint64_t even_carry_ends = even_carries & ~backslash;
+    uint64_t odd_carry_ends = odd_carries & ~backslash;
+    return (even_carry_ends & odd_bits) | (odd_carry_ends & even_bits);
+}
+
+/**
+ * Inclusive prefix XOR: bit i of the result is the parity of bits 0..i.
+ */
+static uint64_t prefix_xor(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+/**
+ * Index one 64-byte block and append its structural positions.
+ *
+ * @param index The index being built
+ * @param block 64 bytes of input
+ * @param base Input offset of the block
+ */
+static void index_block(JsonStructuralIndex* index, const char* block, size_t base) {
+    BlockMasks m;
+    classify_block(block, &m);
+
+    /* Escaped quotes do not open or close strings */
+    uint64_t escaped = find_escaped(m.backslash, &index->prev_escaped);
+    uint64_t quote = m.quote & ~escaped;
+
+    /* Bytes from an opening quote up to (not including) its closing quote */
+    uint64_t in_string = prefix_xor(quote) ^ index->prev_in_string;
+    index->prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+    /* Scalars: everything outside strings that is not whitespace or an operator */
+    uint64_t scalar = ~(m.op | m.whitespace | quote | in_string);
+    uint64_t scalar_start = scalar & ~((scalar << 1) | index->prev_scalar);
+    index->prev_scalar = scalar >> 63;
+
+    uint64_t structurals = (m.op & ~in_string) | (quote & in_string) | scalar_start;
+
+    size_t count = index->count;
+    while (structurals != 0) {
+        index->positions[count++] = base + (size_t)__builtin_ctzll(structurals);
+        structurals &= structurals - 1;
+    }
+    index->count = count;
+}
+
+/**
+ * Start indexing a buffer.
+ *
+ * @param index The index to initialize
+ * @param data Input bytes
+ * @param size Number of input bytes
+ */
+void json_structural_init(JsonStructuralIndex* index, const char* data, size_t size) {
+    select_kernel();
+
+    index->data = data;
+    index->size = size;
+    index->offset = 0;
+    index->prev_in_string = 0;
+    index->prev_escaped = 0;
+    index->prev_scalar = 0;
+    index->count = 0;
+    index->cursor = 0;
+    index->positions = (size_t*)malloc(JSON_STRUCTURAL_BATCH * sizeof(size_t));
+    if (index->positions == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+}
+
+/**
+ * Release the index's batch storage.
+ *
+ * @param index The index to free
+ */
+void json_structural_free(JsonStructuralIndex* index) {
+    free(index->positions);
+    index->positions = NULL;
+}
+
+/**
+ * Index the next batch of input, skipping batches without any structural
+ * (e.g. the middle of a very long string).
+ *
+ * @param index The index to advance
+ * @return 1 if new positions are available, 0 at end of input
+ */
+int json_structural_fill(JsonStructuralIndex* index) {
+    index->count = 0;
+    index->cursor = 0;
+
+    while (index->count == 0 && index->offset < index->size) {
+        size_t end = index->offset + JSON_STRUCTURAL_BATCH;
+        if (end > index->size) {
+            end = index->size;
+        }
+
+        while (index->offset + 64 <= end) {
+            index_block(index, index->data + index->offset, index->offset);
+            index->offset += 64;
+        }
+
+        /* Final partial block: pad with whitespace, which never indexes */
+        if (index->offset < end) {
+            char block[64];
+            memset(block, ' ', sizeof(block));
+            memcpy(block, index->data + index->offset, end - index->offset);
+            index_block(index, block, index->offset);
+            index->offset = end;
+        }
+    }
+
+    return index->count > 0;
+}
@@ -0,0 +1,86 @@
+/**
+ * json_structural.h
+ *
+ * Stage 1 of the fast JSON parser: the structural indexer.
+ * Scans the input 64 bytes at a time with SIMD bit tricks and records the
+ * position of every structural character ({ } [ ] : ,), every opening
+ * quote and the first byte of every scalar (number, true, false, null),
+ * ignoring anything inside strings. Stage 2 (json_parser.c) then builds
+ * the JsonValue tree by walking these positions instead of every byte.
+ *
+ * The index is produced in fixed-size batches as stage 2 consumes it, so
+ * memory stays bounded and the scanned bytes are still in cache when the
+ * tree builder reads them.
+ */
+
+#ifndef JSON_STRUCTURAL_H
+#define JSON_STRUCTURAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Returned by json_structural_next/peek once the input is exhausted */
+#define JSON_STRUCTURAL_END ((size_t)-1)
+
+/* Bytes of input indexed per batch (a multiple of the 64-byte block size) */
+#define JSON_STRUCTURAL_BATCH (16 * 1024)
+
+/**
+ * State of an incremental structural index over one input buffer.
+ */
+typedef struct JsonStructuralIndex {
+    const char* data;                   // Input being indexed
+    size_t size;                        // Number of input bytes
+    size_t offset;                      // Next input byte to index
+    uint64_t prev_in_string;            // All ones if the last block ended inside a string
+    uint64_t prev_escaped;              // 1 if the last block ended with an odd backslash run
+    uint64_t prev_scalar;               // 1 if the last block ended inside a scalar
+    size_t* positions;                  // Structural positions of the current batch
+    size_t count;                       // Number of positions in the batch
+    size_t cursor;                      // Next position to hand out
+} JsonStructuralIndex;
+
+/**
+ * Start indexing a buffer. Nothing is scanned until the first position
+ * is requested.
+ */
+void json_structural_init(JsonStructuralIndex* index, const char* data, size_t size);
+
+/**
+ * Release the index's batch storage.
+ */
+void json_structural_free(JsonStructuralIndex* index);
+
+/**
+ * Index the next batch of input.
+ *
+ * @return 1 if at least one new position is available, 0 at end of input
+ */
+int json_structural_fill(JsonStructuralIndex* index);
+
+/**
+ * Name of the SIMD kernel selected for this CPU ("avx2", "sse2" or "scalar").
+ */
+const char* json_structural_kernel(void);
+
+/**
+ * Consume and return the next structural position, or JSON_STRUCTURAL_END.
+ */
+static inline size_t json_structural_next(JsonStructuralIndex* index) {
+    if (index->cursor == index->count && !json_structural_fill(index)) {
+        return JSON_STRUCTURAL_END;
+    }
+    return index->positions[index->cursor++];
+}
+
+/**
+ * Return the next structural position without consuming it.
+ */
+static inline size_t json_structural_peek(JsonStructuralIndex* index) {
+    if (index->cursor == index->count && !json_structural_fill(index)) {
+        return JSON_STRUCTURAL_END;
+    }
+    return index->positions[index->cursor];
+}
+
+#endif /* JSON_STRUCTURAL_H */
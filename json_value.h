@@ -9,8 +9,11 @@
 #ifndef JSON_VALUE_H
 #define JSON_VALUE_H
 
+#include <stdio.h>
 #include <stdlib.h>
-#include "uthash.h"  // Hash table library for fast object lookups
+#include <stdint.h>
+#include <stdatomic.h>
+#include "json_arena.h"  // Bump allocator for parsed documents
 
 /**
  * Enumeration of all possible JSON value types.
@@ -25,6 +28,13 @@ typedef enum {
     JSON_OBJECT     // Object (key-value pairs)
 } JsonType;
 
+/**
+ * Flags describing how a JsonValue was allocated.
+ */
+#define JSON_FLAG_ARENA 0x01    // Lives in a JsonArena: freed with the arena, never individually
+#define JSON_FLAG_ESCAPED 0x02  // String text still contains JSON escape sequences, as in the input
+#define JSON_FLAG_INTEGER 0x04  // Number is held exactly in value.number.as.integer
+
 /**
  * Forward declaration of JsonValue struct.
  */
@@ -32,39 +42,154 @@ struct JsonValue;
 
 /**
  * Represents a single member of a JSON object.
- * NOW USES UTHASH for O(1) lookups instead of linked list.
- * Note: 'next' field is kept for temporary use during parsing.
  */
 typedef struct JsonObjectMember {
-    char* key;                          // The key (field name) - also the hash key
+    const char* key;                    // The key, unescaped: an atom (json_atom.h) or a private copy
+    size_t key_length;                  // Length of the key in bytes
+    uint32_t hash;                      // json_hash_key() of the key
+    uint8_t key_copied;                 // Set if key is a private copy, freed with the object
     struct JsonValue* value;            // Pointer to the value
-    UT_hash_handle hh;                  // Makes this structure hashable by uthash
-    struct JsonObjectMember* next;      // Temporary: used during parsing, then discarded
 } JsonObjectMember;
 
+/* Objects with more members than this also get a hash index */
+#define JSON_OBJECT_INDEX_THRESHOLD 8
+
 /**
- * Represents a single element in a JSON array.
- * Arrays are stored as linked lists of values.
+ * Represents the members of a JSON object.
+ * Members are kept in a contiguous buffer in insertion order; small
+ * objects are searched linearly (comparing hashes first). Once an object
+ * grows past JSON_OBJECT_INDEX_THRESHOLD members it also gets an
+ * open-addressing index of 2 * capacity slots, each holding a member
+ * position plus one (0 marks an empty slot). The shape identifies the
+ * object's key sequence (see json_shape.h).
  */
-typedef struct JsonArrayElement {
-    struct JsonValue* value;            // Pointer to the value
-    struct JsonArrayElement* next;      // Pointer to next element in the list
-} JsonArrayElement;
+typedef struct JsonObject {
+    JsonObjectMember* members;          // Members, in insertion order
+    uint32_t* index;                    // Hash index, or NULL for small objects
+    uint32_t length;                    // Number of members in use
+    uint32_t capacity;                  // Allocated members (a power of two)
+    uint32_t shape;                     // Shape of the key sequence, or JSON_SHAPE_NONE
+} JsonObject;
+
+/**
+ * An object key prepared for repeated lookups (e.g. a query's field name):
+ * its length and hash are computed once, and it is interned so that it
+ * matches object members by pointer. It also acts as an inline cache,
+ * remembering the member position it was last found at for one object
+ * shape; the cache is atomic because worker threads share the query.
+ */
+typedef struct JsonKey {
+    char* name;                         // The key, NUL-terminated (owned)
+    size_t length;                      // Length of the key in bytes
+    uint32_t hash;                      // json_hash_key() of the key
+    const char* atom;                   // Interned key, or name if it could not be interned
+    _Atomic uint64_t shape_cache;       // (shape << 32) | member position; shape 0 = empty
+} JsonKey;
+
+/* Column row type for elements that are not objects or lack the field */
+#define JSON_COLUMN_MISSING 0xFF
+
+/**
+ * One field of every element of an array of records, stored by type in
+ * contiguous buffers so that filters scan memory instead of chasing
+ * pointers. The parser builds columns only for fields a query filters on
+ * (see JsonProjection); row k describes element k of the array.
+ */
+typedef struct JsonColumn {
+    const char* key;                    // The field's atom (json_atom.h)
+    unsigned char* types;               // JsonType of each row's value, or JSON_COLUMN_MISSING
+    double* numbers;                    // Value of each JSON_NUMBER row (0 elsewhere)
+    size_t length;                      // Number of rows
+    size_t capacity;                    // Allocated rows
+    struct JsonColumn* next;            // Next column of the same array
+} JsonColumn;
+
+/**
+ * Represents the elements of a JSON array.
+ * Stored as a growable contiguous buffer of value pointers so that
+ * indexing and length are O(1) and appends are amortized O(1).
+ */
+typedef struct JsonArray {
+    struct JsonValue** items;           // Element pointers, in document order
+    size_t length;                      // Number of elements in use
+    size_t capacity;                    // Number of allocated slots in items
+    JsonColumn* columns;                // Columnar copies of some fields, or NULL
+} JsonArray;
+
+/**
+ * Represents a JSON string as a span of bytes.
+ * Strings parsed into an arena point straight into the input buffer, so
+ * the text is not NUL-terminated and the input must be kept alive for as
+ * long as the document is used. If JSON_FLAG_ESCAPED is set the span is
+ * the raw text between the quotes, escapes included.
+ */
+typedef struct JsonString {
+    const char* data;                   // First byte of the string text
+    size_t length;                      // Length of the text in bytes
+} JsonString;
+
+/**
+ * Represents a JSON number.
+ * Integral literals that fit in 64 bits are stored exactly as integers
+ * (JSON_FLAG_INTEGER); everything else as a double. Numbers parsed into
+ * an arena also remember their original text so it can be re-emitted
+ * unchanged (--raw-numbers).
+ */
+typedef struct JsonNumber {
+    union {
+        double real;                    // Value when JSON_FLAG_INTEGER is clear
+        int64_t integer;                // Value when JSON_FLAG_INTEGER is set
+    } as;
+    const char* raw;                    // Original literal in the input, or NULL
+    size_t raw_length;                  // Length of the literal
+} JsonNumber;
 
 /**
  * Represents any JSON value.
  * Uses a union to store different value types efficiently.
+ *
+ * Heap values are reference counted: a new value starts with one
+ * reference, json_value_retain() adds one and free_json_value() drops
+ * one, freeing the value when the last is gone. Containers hold a
+ * reference on each child, so subtrees can be shared between documents
+ * and results. A shared value must not be modified in place; see
+ * json_value_unshare(). Arena values are not counted: they live as long
+ * as their arena.
  */
 typedef struct JsonValue {
-    JsonType type;                      // The type of this JSON value
+    JsonType type : 8;                  // The type of this JSON value
+    unsigned int flags : 24;            // JSON_FLAG_* allocation flags
+    _Atomic uint32_t refcount;          // References to a heap value (unused in arenas)
     union {
-        double number;                  // For JSON_NUMBER
-        char* string;                   // For JSON_STRING
-        JsonArrayElement* array;        // For JSON_ARRAY (head of linked list)
-        JsonObjectMember* object;       // For JSON_OBJECT (head of hash table)
+        JsonNumber number;              // For JSON_NUMBER
+        JsonString string;              // For JSON_STRING
+        JsonArray array;                // For JSON_ARRAY (contiguous element buffer)
+        JsonObject object;              // For JSON_OBJECT (flat member buffer)
     } value;
 } JsonValue;
 
+/**
+ * Get the value of a JSON number as a double.
+ */
+static inline double json_number_value(const JsonValue* value) {
+    if (value->flags & JSON_FLAG_INTEGER) {
+        return (double)value->value.number.as.integer;
+    }
+    return value->value.number.as.real;
+}
+
+/**
+ * Hash an object key (32-bit FNV-1a).
+ */
+static inline uint32_t json_hash_key(const char* key, size_t length) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return hash;
+}
+
 /**
  * Enumeration for comparison operators in select() expressions.
  */
@@ -97,7 +222,8 @@ typedef enum {
     QUERY_PIPE,         // Pipe operator: |
     QUERY_SELECT,       // Filter with select(): select(condition)
     QUERY_SLICE,        // Array slice: [start:end]
-    QUERY_ARRAY_ITER    // Array iteration: .[]
+    QUERY_ARRAY_ITER,   // Array iteration: .[]
+    QUERY_FOLDED_INDEX  // [a:b] | [i] folded into one index by the optimizer
 } QueryNodeType;
 
 /**
@@ -107,7 +233,7 @@ typedef enum {
 typedef struct QueryNode {
     QueryNodeType type;         // Type of this query operation
     union {
-        char* field;            // For QUERY_FIELD
+        JsonKey field;          // For QUERY_FIELD
         int index;              // For QUERY_INDEX
         struct {
             int start;          // For QUERY_SLICE
@@ -118,6 +244,10 @@ typedef struct QueryNode {
             struct QueryNode* right;
         } pipe;
         ConditionExpr* condition;     // For QUERY_SELECT
+        struct {
+            int position;       // For QUERY_FOLDED_INDEX: a + i
+            int written;        // i, as the query wrote it
+        } folded;
     } data;
     struct QueryNode* next;     // Next operation in the query chain
 } QueryNode;
@@ -139,11 +269,33 @@ JsonValue* create_json_bool(int is_true);
  */
 JsonValue* create_json_number(double num);
 
+/**
+ * Create a new JSON number value from a literal that matches the JSON
+ * number grammar (see json_number.h). While an arena is current the
+ * value also keeps a pointer to the literal for --raw-numbers output.
+ */
+JsonValue* create_json_number_text(const char* text, size_t length);
+
 /**
  * Create a new JSON string value.
  */
 JsonValue* create_json_string(const char* str);
 
+/**
+ * Create a new JSON string value from `len` bytes that need not be
+ * NUL-terminated.
+ */
+JsonValue* create_json_string_len(const char* str, size_t len);
+
+/**
+ * Create a JSON string value for `len` bytes of parser input.
+ * While an arena is current the value refers to the input in place;
+ * otherwise the bytes are copied.
+ *
+ * @param escaped Nonzero if the bytes still contain escape sequences
+ */
+JsonValue* create_json_string_span(const char* str, size_t len, int escaped);
+
 /**
  * Create a new empty JSON array.
  */
@@ -154,31 +306,99 @@ JsonValue* create_json_array();
  */
 JsonValue* create_json_object();
 
+/**
+ * Make sure a JSON array has room for at least `capacity` elements.
+ */
+void json_array_reserve(JsonValue* array, size_t capacity);
+
 /**
  * Add an element to a JSON array.
  */
 void json_array_add(JsonValue* array, JsonValue* element);
 
 /**
- * Add a member (key-value pair) to a JSON object using hash table.
+ * Make sure a JSON object has room for at least `capacity` members.
+ */
+void json_object_reserve(JsonValue* object, size_t capacity);
+
+/**
+ * Add a member (key-value pair) to a JSON object.
+ * If the key is already present its value is replaced.
  */
 void json_object_add(JsonValue* object, const char* key, JsonValue* value);
 
 /**
- * Find a member in a JSON object by key (O(1) with hash table).
+ * Add a member whose key is given by pointer and length. The key is
+ * interned, so the caller's buffer is not retained. If the key is
+ * already present its value is replaced.
+ */
+void json_object_add_member(JsonValue* object, const char* key, size_t key_length,
+                            JsonValue* value);
+
+/**
+ * Find a member in a JSON object by key.
  */
 JsonValue* json_object_get(JsonValue* object, const char* key);
 
 /**
- * Print a JSON value to stdout.
+ * Find a member in a JSON object by a prepared key (no hashing; a single
+ * indexed load when the object has the shape the key last matched).
+ */
+JsonValue* json_object_get_key(JsonValue* object, JsonKey* key);
+
+/**
+ * Print a JSON value to stdout through the output buffer (see
+ * json_output.h); flush it with json_output_flush().
  */
 void print_json_value(JsonValue* value, int indent);
 
 /**
- * Free memory allocated for a JSON value and all its children.
+ * Make print_json_value() re-emit parsed numbers exactly as they were
+ * written in the input instead of formatting their values.
+ */
+void json_print_raw_numbers(int enabled);
+
+/**
+ * Make print_json_value() print compact JSON on a single line instead of
+ * indenting it.
+ */
+void json_print_compact(int enabled);
+
+/**
+ * Make print_json_result() print string results without quotes, escape
+ * sequences decoded.
+ */
+void json_print_raw_strings(int enabled);
+
+/**
+ * Print a query result: print_json_value(), except for string results
+ * when raw strings are enabled.
+ */
+void print_json_result(JsonValue* value, int indent);
+
+/**
+ * Drop a reference to a JSON value, freeing it and releasing its
+ * children when it was the last one.
  */
 void free_json_value(JsonValue* value);
 
+/**
+ * Add a reference to a JSON value.
+ *
+ * @return The value
+ */
+JsonValue* json_value_retain(JsonValue* value);
+
+/**
+ * Copy on write: get a version of a value that may be modified in place.
+ * Takes over the caller's reference.
+ *
+ * @return The value itself if it is a heap value the caller held the only
+ *         reference to, otherwise a heap copy sharing the original's heap
+ *         children (arena children are deep-copied)
+ */
+JsonValue* json_value_unshare(JsonValue* value);
+
 /**
  * Clone a JSON value (deep copy).
  */
@@ -188,14 +408,99 @@ JsonValue* clone_json_value(JsonValue* value);
 
 /**
  * Execute a query on JSON data and return the result.
+ * Results share the input's nodes instead of copying them. The caller
+ * owns one reference to the result and releases it with
+ * free_json_value(). Arrays built along the way come from the current
+ * arena when one is set.
  */
 JsonValue* execute_query(QueryNode* query, JsonValue* json_data);
 
+/**
+ * A query compiled to bytecode (see compile_query()).
+ */
+typedef struct QueryProgram QueryProgram;
+
+/**
+ * Compile a query AST to a flat bytecode program, run by a threaded
+ * interpreter loop. Compile once and execute the program on every input.
+ *
+ * @param query The query AST (must outlive the program)
+ * @return The program
+ */
+QueryProgram* compile_query(QueryNode* query);
+
+/**
+ * Free a compiled query.
+ */
+void free_query_program(QueryProgram* program);
+
+/**
+ * Execute a compiled query and return the complete result, like
+ * execute_query().
+ */
+JsonValue* execute_program(const QueryProgram* program, JsonValue* json_data);
+
+/**
+ * A query result whose array stages run on demand (see execute_query_stream()).
+ */
+typedef struct JsonStream JsonStream;
+
+/**
+ * Start executing a query without materializing its array stages: .[],
+ * select() and slices become generators that pull one element at a time
+ * from the stage before them, so nothing is computed until the result is
+ * consumed and nothing past what the consumer takes.
+ *
+ * @param query The query AST
+ * @param json_data The JSON data to query (must outlive the stream)
+ * @return The result, or NULL on error (a message is printed to stderr)
+ */
+JsonStream* execute_query_stream(QueryNode* query, JsonValue* json_data);
+
+/**
+ * Start executing a compiled query, like execute_query_stream().
+ * The program must outlive the stream.
+ */
+JsonStream* execute_program_stream(const QueryProgram* program, JsonValue* json_data);
+
+/**
+ * Print a query result like print_json_value(), producing each element of
+ * a lazy array just before it is printed.
+ */
+void print_json_stream(JsonStream* stream, int indent);
+
+/**
+ * Free a query result, including the elements it has not produced.
+ */
+void free_json_stream(JsonStream* stream);
+
+/**
+ * Rewrite a parsed query into an equivalent one that does less work
+ * (flattened pipes, `.[] | select(...)` as a single filter, consecutive
+ * slices and indexes folded together). Run it before compiling the query
+ * or deriving its parse projection.
+ *
+ * @param query The parsed query (taken over; nodes it drops are freed)
+ * @return The optimized query
+ */
+QueryNode* optimize_query(QueryNode* query);
+
+/**
+ * Print a query's plan: the query in query syntax, then the bytecode it
+ * compiles to.
+ */
+void explain_query(QueryNode* query, FILE* out);
+
 /**
  * Free memory allocated for a query AST.
  */
 void free_query(QueryNode* query);
 
+/**
+ * Create a new query node for field access, taking ownership of `name`.
+ */
+QueryNode* create_field_node(char* name);
+
 /**
  * Create a new query node for pipe operation.
  */
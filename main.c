@@ -10,12 +10,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include "json_value.h"
+#include "json_input.h"
+#include "json_parser.h"
+#include "json_parallel.h"
+#include "json_shape.h"
+#include "json_output.h"
 
 /* External declarations for the parsers */
 
 /* JSON parser functions and variables */
 extern int json_yyparse(void);
-extern void json_yy_scan_string(const char* str);
+extern void* json_yy_scan_buffer(char* base, size_t size);
 extern void json_yy_delete_buffer(void* buffer);
 extern JsonValue* json_result;
 
@@ -26,56 +31,180 @@ extern void query_yy_delete_buffer(void* buffer);
 extern QueryNode* query_result;
 
 /**
- * Read the entire contents of a file into a string.
- * 
- * @param filename The path to the file
- * @return A newly allocated string containing the file contents, or NULL on error
+ * Check whether a line holds nothing but whitespace.
  */
-char* read_file(const char* filename) {
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
+static int is_blank_line(const char* line, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Run the query against every record of a newline-delimited JSON file.
+ * Records are parsed, queried and printed one at a time into a single
+ * arena that is reset between records, so memory stays bounded by the
+ * largest record rather than the file size.
+ *
+ * @param query The parsed query
+ * @param filename Path of the input file, or "-" for standard input
+ * @return 0 if every record succeeded, 1 otherwise
+ */
+static int run_lines(QueryNode* query, const char* filename) {
+    JsonLineReader reader;
+    if (json_line_reader_open(&reader, filename) != 0) {
         fprintf(stderr, "Error: Could not open file '%s'\n", filename);
-        return NULL;
+        return 1;
     }
     
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    /* Only the parts of each record the query can reach are built */
+    JsonProjection* projection = json_projection_create(query);
+    QueryProgram* program = compile_query(query);
+    JsonArena* arena = json_arena_create(0);
+    int status = 0;
+    const char* line;
+    size_t length;
+    int read_status;
     
-    // Allocate buffer and read file
-    char* buffer = (char*)malloc(size + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Error: Memory allocation failed\n");
-        fclose(file);
-        return NULL;
+    while ((read_status = json_line_reader_next(&reader, &line, &length)) > 0) {
+        if (is_blank_line(line, length)) {
+            continue;
+        }
+        
+        /* Query temporaries come from the record's arena too */
+        json_arena_set_current(arena);
+        JsonValue* record = json_parse_projected(line, length, projection);
+        if (record == NULL) {
+            fprintf(stderr, "Error: Failed to parse JSON on line %lu\n",
+                    (unsigned long)reader.line_number);
+            status = 1;
+        } else {
+            JsonStream* result = execute_program_stream(program, record);
+            if (result == NULL) {
+                fprintf(stderr, "Error: Query execution failed on line %lu\n",
+                        (unsigned long)reader.line_number);
+                status = 1;
+            } else {
+                print_json_stream(result, 0);
+                json_output_line_end();
+                free_json_stream(result);
+            }
+        }
+        json_arena_set_current(NULL);
+        json_arena_reset(arena);
     }
     
-    size_t bytes_read = fread(buffer, 1, size, file);
-    buffer[bytes_read] = '\0';
+    if (read_status < 0) {
+        fprintf(stderr, "Error: Failed to read '%s'\n", filename);
+        status = 1;
+    }
     
-    fclose(file);
-    return buffer;
+    json_output_flush();
+    json_arena_destroy(arena);
+    free_query_program(program);
+    json_projection_free(projection);
+    json_line_reader_close(&reader);
+    return status;
+}
+
+/**
+ * Print the counters collected for --stats to stderr.
+ */
+static void print_stats(void) {
+    JsonShapeStats stats;
+    json_shape_get_stats(&stats);
+    
+    unsigned long long lookups = stats.cache_hits + stats.cache_misses;
+    fprintf(stderr, "Stats: %llu field lookups, %llu inline cache hits (%.1f%%), %llu misses, %llu object shapes\n",
+            lookups, (unsigned long long)stats.cache_hits,
+            lookups ? 100.0 * (double)stats.cache_hits / (double)lookups : 0.0,
+            (unsigned long long)stats.cache_misses, (unsigned long long)stats.shapes);
 }
 
 /**
  * Main entry point.
  * 
- * Usage: jqlite '<query>' <json_file>
+ * Usage: jqlite [--flex] [--lines] [--threads N [--unordered]] [-c] [-r] [--raw-numbers] [--stats] [--explain] '<query>' <json_file>
  */
 int main(int argc, char** argv) {
+    int use_flex = 0;
+    int use_lines = 0;
+    int threads = 0;
+    int ordered = 1;
+    int show_stats = 0;
+    int explain = 0;
+    int argi = 1;
+    
+    // Parse options
+    while (argi < argc && argv[argi][0] == '-' && argv[argi][1] != '\0') {
+        if (strcmp(argv[argi], "--flex") == 0) {
+            use_flex = 1;
+        } else if (strcmp(argv[argi], "--lines") == 0) {
+            use_lines = 1;
+        } else if (strcmp(argv[argi], "--threads") == 0) {
+            threads = argi + 1 < argc ? atoi(argv[++argi]) : 0;
+            if (threads < 1 || threads > JSON_PARALLEL_MAX_THREADS) {
+                fprintf(stderr, "Error: --threads needs a value between 1 and %d\n",
+                        JSON_PARALLEL_MAX_THREADS);
+                return 1;
+            }
+            use_lines = 1;
+        } else if (strcmp(argv[argi], "--unordered") == 0) {
+            ordered = 0;
+        } else if (strcmp(argv[argi], "-c") == 0 || strcmp(argv[argi], "--compact-output") == 0) {
+            json_print_compact(1);
+        } else if (strcmp(argv[argi], "-r") == 0 || strcmp(argv[argi], "--raw-output") == 0) {
+            json_print_raw_strings(1);
+        } else if (strcmp(argv[argi], "--raw-numbers") == 0) {
+            json_print_raw_numbers(1);
+        } else if (strcmp(argv[argi], "--stats") == 0) {
+            show_stats = 1;
+            json_shape_enable_stats();
+        } else if (strcmp(argv[argi], "--explain") == 0) {
+            explain = 1;
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[argi]);
+            return 1;
+        }
+        argi++;
+    }
+    
     // Check command-line arguments
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s '<query>' <json_file>\n", argv[0]);
+    if (argc - argi != 2) {
+        fprintf(stderr, "Usage: %s [--flex] [--lines] [--threads N [--unordered]] [-c] [-r] [--raw-numbers] [--stats] [--explain] '<query>' <json_file>\n", argv[0]);
         fprintf(stderr, "Example: %s '.posts[0].title' data.json\n", argv[0]);
+        fprintf(stderr, "  --flex       Parse JSON with the flex/Bison grammar instead of the SIMD parser\n");
+        fprintf(stderr, "  --lines      Treat the input as newline-delimited JSON, one record per line\n");
+        fprintf(stderr, "  --threads N  Process newline-delimited JSON with N worker threads\n");
+        fprintf(stderr, "  --unordered  With --threads, print results as soon as they are ready\n");
+        fprintf(stderr, "  -c, --compact-output  Print each result on a single line\n");
+        fprintf(stderr, "  -r, --raw-output      Print string results without quotes or escapes\n");
+        fprintf(stderr, "  --raw-numbers  Print numbers from the input exactly as written\n");
+        fprintf(stderr, "  --stats      Report field lookup inline cache hit rates on stderr\n");
+        fprintf(stderr, "  --explain    Print the optimized query, its bytecode and parse projection on stderr\n");
+        return 1;
+    }
+    
+    if (!ordered && threads == 0) {
+        fprintf(stderr, "Error: --unordered requires --threads\n");
+        return 1;
+    }
+    
+    if (use_flex && use_lines) {
+        fprintf(stderr, "Error: --flex cannot be combined with --lines or --threads\n");
         return 1;
     }
     
-    const char* query_string = argv[1];
-    const char* json_filename = argv[2];
+    const char* query_string = argv[argi];
+    const char* json_filename = argv[argi + 1];
     
     // Step 1: Parse the query string
-    printf("Parsing query: %s\n", query_string);
+    if (!use_lines) {
+        printf("Parsing query: %s\n", query_string);
+    }
     query_yy_scan_string(query_string);
     
     if (query_yyparse() != 0) {
@@ -88,54 +217,114 @@ int main(int argc, char** argv) {
         return 1;
     }
     
+    /* Everything below runs the rewritten query */
+    query_result = optimize_query(query_result);
+    if (explain) {
+        explain_query(query_result, stderr);
+        if (!use_flex) {
+            JsonProjection* projection = json_projection_create(query_result);
+            json_projection_print(projection, stderr);
+            json_projection_free(projection);
+        }
+    }
+    
+    if (use_lines) {
+        int status = threads > 0
+            ? json_parallel_run(query_result, json_filename, threads, ordered)
+            : run_lines(query_result, json_filename);
+        free_query(query_result);
+        if (show_stats) {
+            print_stats();
+        }
+        return status;
+    }
+    
     printf("Query parsed successfully.\n\n");
     
     // Step 2: Read and parse the JSON file
     printf("Reading JSON file: %s\n", json_filename);
-    char* json_content = read_file(json_filename);
-    if (json_content == NULL) {
+    JsonInput json_input;
+    if (json_input_open(&json_input, json_filename) != 0) {
+        fprintf(stderr, "Error: Could not open file '%s'\n", json_filename);
         free_query(query_result);
         return 1;
     }
     
     printf("Parsing JSON...\n");
-    json_yy_scan_string(json_content);
     
-    if (json_yyparse() != 0) {
+    /* The whole document is allocated from one arena */
+    JsonArena* json_arena = json_arena_create(0);
+    json_arena_set_current(json_arena);
+    int parse_status;
+    
+    if (use_flex) {
+        /* Scan the mapped input in place; the padding supplies flex's two NULs */
+        void* json_buffer = json_yy_scan_buffer(json_input.data,
+                                                json_input.size + JSON_INPUT_PADDING);
+        parse_status = json_yyparse();
+        json_yy_delete_buffer(json_buffer);
+    } else {
+        /* Skip everything the query cannot reach */
+        JsonProjection* projection = json_projection_create(query_result);
+        json_result = json_parse_projected(json_input.data, json_input.size, projection);
+        json_projection_free(projection);
+        parse_status = json_result == NULL ? 1 : 0;
+    }
+    json_arena_set_current(NULL);
+    
+    if (parse_status != 0) {
         fprintf(stderr, "Error: Failed to parse JSON\n");
-        free(json_content);
+        json_arena_destroy(json_arena);
+        json_input_close(&json_input);
         free_query(query_result);
         return 1;
     }
     
     if (json_result == NULL) {
         fprintf(stderr, "Error: JSON parsing produced no result\n");
-        free(json_content);
+        json_arena_destroy(json_arena);
+        json_input_close(&json_input);
         free_query(query_result);
         return 1;
     }
     
     printf("JSON parsed successfully.\n\n");
-    free(json_content);
+    
+    /* Strings in the document point into the input buffer, so it is
+     * only released after the result has been printed */
     
     // Step 3: Execute the query on the JSON data
     printf("Executing query...\n");
-    JsonValue* result = execute_query(query_result, json_result);
+    /* Results point into the document; values computed along the way are
+     * released with its arena */
+    json_arena_set_current(json_arena);
+    JsonStream* result = execute_query_stream(query_result, json_result);
     
     if (result == NULL) {
         fprintf(stderr, "Error: Query execution failed\n");
-        free_json_value(json_result);
+        json_arena_set_current(NULL);
+        json_arena_destroy(json_arena);
+        json_input_close(&json_input);
         free_query(query_result);
         return 1;
     }
     
-    // Step 4: Print the result
+    // Step 4: Print the result; elements of .[], select() and slices are
+    // computed as they are printed
     printf("\nResult:\n");
-    print_json_value(result, 0);
-    printf("\n");
+    print_json_stream(result, 0);
+    json_output_line_end();
+    json_output_flush();
+    json_arena_set_current(NULL);
+    
+    if (show_stats) {
+        print_stats();
+    }
     
     // Clean up
-    free_json_value(json_result);
+    free_json_stream(result);
+    json_arena_destroy(json_arena);
+    json_input_close(&json_input);
     free_query(query_result);
     
     return 0;
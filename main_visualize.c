@@ -12,6 +12,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include "json_value.h"
+#include "json_input.h"
+#include "json_output.h"
 
 /* Global visualization mode flag */
 int g_visualize_mode = 0;
@@ -20,7 +22,7 @@ int g_visualize_mode = 0;
 
 /* JSON parser functions and variables */
 extern int json_yyparse(void);
-extern void json_yy_scan_string(const char* str);
+extern void* json_yy_scan_buffer(char* base, size_t size);
 extern void json_yy_delete_buffer(void* buffer);
 extern JsonValue* json_result;
 
@@ -30,43 +32,6 @@ extern void query_yy_scan_string(const char* str);
 extern void query_yy_delete_buffer(void* buffer);
 extern QueryNode* query_result;
 
-/**
- * Read the entire contents of a file into a string.
- * 
- * @param filename The path to the file
- * @return A newly allocated string containing the file contents, or NULL on error
- */
-char* read_file(const char* filename) {
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
-        if (!g_visualize_mode) {
-            fprintf(stderr, "Error: Could not open file '%s'\n", filename);
-        }
-        return NULL;
-    }
-    
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    // Allocate buffer and read file
-    char* buffer = (char*)malloc(size + 1);
-    if (buffer == NULL) {
-        if (!g_visualize_mode) {
-            fprintf(stderr, "Error: Memory allocation failed\n");
-        }
-        fclose(file);
-        return NULL;
-    }
-    
-    size_t bytes_read = fread(buffer, 1, size, file);
-    buffer[bytes_read] = '\0';
-    
-    fclose(file);
-    return buffer;
-}
-
 /**
  * Main entry point.
  * 
@@ -133,10 +98,12 @@ int main(int argc, char** argv) {
         printf("Reading JSON file: %s\n", json_filename);
     }
     
-    char* json_content = read_file(json_filename);
-    if (json_content == NULL) {
+    JsonInput json_input;
+    if (json_input_open(&json_input, json_filename) != 0) {
         if (g_visualize_mode) {
             printf("],\"executionTrace\":[],\"error\":\"Could not read JSON file\"}");
+        } else {
+            fprintf(stderr, "Error: Could not open file '%s'\n", json_filename);
         }
         free_query(query_result);
         return 1;
@@ -146,15 +113,25 @@ int main(int argc, char** argv) {
         printf("Parsing JSON...\n");
     }
     
-    json_yy_scan_string(json_content);
+    /* Scan the mapped input in place; the padding supplies flex's two NULs */
+    void* json_buffer = json_yy_scan_buffer(json_input.data,
+                                            json_input.size + JSON_INPUT_PADDING);
+    
+    /* The whole document is allocated from one arena */
+    JsonArena* json_arena = json_arena_create(0);
+    json_arena_set_current(json_arena);
+    int parse_status = json_yyparse();
+    json_arena_set_current(NULL);
+    json_yy_delete_buffer(json_buffer);
     
-    if (json_yyparse() != 0) {
+    if (parse_status != 0) {
         if (g_visualize_mode) {
             printf("],\"executionTrace\":[],\"error\":\"Failed to parse JSON\"}");
         } else {
             fprintf(stderr, "Error: Failed to parse JSON\n");
         }
-        free(json_content);
+        json_arena_destroy(json_arena);
+        json_input_close(&json_input);
         free_query(query_result);
         return 1;
     }
@@ -165,7 +142,8 @@ int main(int argc, char** argv) {
         } else {
             fprintf(stderr, "Error: JSON parsing produced no result\n");
         }
-        free(json_content);
+        json_arena_destroy(json_arena);
+        json_input_close(&json_input);
         free_query(query_result);
         return 1;
     }
@@ -173,7 +151,6 @@ int main(int argc, char** argv) {
     if (!g_visualize_mode) {
         printf("JSON parsed successfully.\n\n");
     }
-    free(json_content);
     
     // Close parseSteps and start executionTrace in visualize mode
     if (g_visualize_mode) {
@@ -185,7 +162,11 @@ int main(int argc, char** argv) {
         printf("Executing query...\n");
     }
     
+    /* Results point into the document; the arrays built along the way are
+     * released with its arena */
+    json_arena_set_current(json_arena);
     JsonValue* result = execute_query(query_result, json_result);
+    json_arena_set_current(NULL);
     
     if (result == NULL) {
         if (g_visualize_mode) {
@@ -193,7 +174,8 @@ int main(int argc, char** argv) {
         } else {
             fprintf(stderr, "Error: Query execution failed\n");
         }
-        free_json_value(json_result);
+        json_arena_destroy(json_arena);
+        json_input_close(&json_input);
         free_query(query_result);
         return 1;
     }
@@ -203,15 +185,19 @@ int main(int argc, char** argv) {
         // Close executionTrace array
         printf("],\"finalResult\":");
         print_json_value(result, 0);
+        json_output_flush();
         printf("}");
     } else {
         printf("\nResult:\n");
         print_json_value(result, 0);
+        json_output_flush();
         printf("\n");
     }
     
     // Clean up
-    free_json_value(json_result);
+    free_json_value(result);
+    json_arena_destroy(json_arena);
+    json_input_close(&json_input);
     free_query(query_result);
     
     return 0;
@@ -99,12 +99,8 @@ simple_operation:
         $$ = node;
     }
     | DOT IDENT                 {
-        /* Field access */
-        QueryNode* node = (QueryNode*)malloc(sizeof(QueryNode));
-        node->type = QUERY_FIELD;
-        node->data.field = $2;
-        node->next = NULL;
-        $$ = node;
+        /* Field access (key length and hash are computed once, here) */
+        $$ = create_field_node($2);
     }
     | DOT LBRACK RBRACK         {
         /* Array iteration: .[] */
@@ -164,12 +160,7 @@ condition:
         ConditionExpr* cond = (ConditionExpr*)malloc(sizeof(ConditionExpr));
         
         /* Create a sub-query node for the field access */
-        QueryNode* field_node = (QueryNode*)malloc(sizeof(QueryNode));
-        field_node->type = QUERY_FIELD;
-        field_node->data.field = $2;
-        field_node->next = NULL;
-        
-        cond->left = field_node;
+        cond->left = create_field_node($2);
         cond->op = $3;
         cond->value = $4;
         $$ = cond;
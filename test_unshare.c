@@ -0,0 +1,124 @@
+/**
+ * test_unshare.c
+ *
+ * Checks for json_value_unshare(): a shared value is copied before it is
+ * modified, the original keeps its contents, heap children are shared
+ * with the copy, and children of an arena document are copied out of the
+ * arena so the copy survives the document.
+ *
+ * Build and run with `make test`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json_value.h"
+#include "json_arena.h"
+#include "json_parser.h"
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+/**
+ * A value with a single reference comes back as is.
+ */
+static void test_sole_owner(void) {
+    JsonValue* array = create_json_array();
+    CHECK(json_value_unshare(array) == array);
+    free_json_value(array);
+}
+
+/**
+ * A shared heap array is copied; mutating the copy leaves the original
+ * alone, and the children are shared rather than copied.
+ */
+static void test_shared_heap_value(void) {
+    JsonValue* child = create_json_object();
+    json_object_add(child, "name", create_json_string("first"));
+    JsonValue* original = create_json_array();
+    json_array_add(original, child);
+
+    JsonValue* copy = json_value_unshare(json_value_retain(original));
+    CHECK(copy != original);
+    CHECK(copy->value.array.items[0] == child);
+
+    json_array_add(copy, create_json_number(7));
+    CHECK(original->value.array.length == 1);
+    CHECK(copy->value.array.length == 2);
+
+    /* The shared child must itself be unshared before it is modified */
+    JsonValue* copied_child = json_value_unshare(json_value_retain(child));
+    CHECK(copied_child != child);
+    json_object_add(copied_child, "name", create_json_string("second"));
+    CHECK(strcmp(json_object_get(child, "name")->value.string.data, "first") == 0);
+    CHECK(strcmp(json_object_get(copied_child, "name")->value.string.data, "second") == 0);
+
+    free_json_value(copied_child);
+    free_json_value(copy);
+    free_json_value(original);
+}
+
+/**
+ * A value from an arena document is copied to the heap together with its
+ * arena children, and stays usable after the arena and input are gone.
+ */
+static void test_arena_value(void) {
+    static const char text[] = "{\"items\": [{\"id\": 1, \"tag\": \"a\\\"b\"}, [2, 3]]}";
+    char* input = (char*)malloc(sizeof(text));
+    memcpy(input, text, sizeof(text));
+
+    JsonArena* arena = json_arena_create(0);
+    json_arena_set_current(arena);
+    JsonValue* root = json_parse_projected(input, sizeof(text) - 1, NULL);
+    CHECK(root != NULL);
+    if (root == NULL) {
+        json_arena_set_current(NULL);
+        json_arena_destroy(arena);
+        free(input);
+        return;
+    }
+    JsonValue* items = json_value_unshare(json_object_get(root, "items"));
+    json_arena_set_current(NULL);
+
+    CHECK(!(items->flags & JSON_FLAG_ARENA));
+    json_arena_destroy(arena);
+    memset(input, 0, sizeof(text));
+    free(input);
+
+    /* Children are heap copies held only by the copy, so they can be
+     * changed in place */
+    JsonValue* record = items->value.array.items[0];
+    CHECK(!(record->flags & JSON_FLAG_ARENA));
+    CHECK(json_value_unshare(record) == record);
+    json_object_add(record, "id", create_json_number(5));
+    CHECK(json_number_value(json_object_get(record, "id")) == 5);
+
+    JsonValue* tag = json_object_get(record, "tag");
+    CHECK(tag->value.string.length == 4 && memcmp(tag->value.string.data, "a\\\"b", 4) == 0);
+    JsonValue* pair = items->value.array.items[1];
+    CHECK(pair->value.array.length == 2 &&
+          json_number_value(pair->value.array.items[1]) == 3);
+
+    json_array_add(items, create_json_null());
+    CHECK(items->value.array.length == 3);
+    free_json_value(items);
+}
+
+int main(void) {
+    test_sole_owner();
+    test_shared_heap_value();
+    test_arena_value();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("test_unshare: all checks passed\n");
+    return 0;
+}